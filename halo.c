@@ -2,21 +2,98 @@
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
 #include <janet.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "http_parser.h"
 #include "sandbird.h"
+#include "router.h"
+
+typedef struct Server Server;
+typedef struct Connection Connection;
+
+/* A worker is one event loop with its own listening socket. The first runs
+ * on the thread which started the server; the others each run a Janet VM of
+ * their own on a separate thread, with a copy of the handler marshalled
+ * across to it. */
+typedef struct {
+  sb_Server *server;
+  JanetFunction *handler;
+  JanetTable *env;
+  JanetStream *stream;
+  Server *owner;
+  pthread_t thread;
+  int started;
+  /* Finished handler fibers, reset and reused for later requests */
+  JanetFiber **fibers;
+  int32_t fiber_count;
+  int32_t fiber_cap;
+  int32_t stack_size;
+  size_t fiber_hits;
+  size_t fiber_misses;
+  /* Connections whose handler has not responded yet */
+  Connection *pending;
+  int lazy_request;
+} Worker;
+
+struct Server {
+  Worker *workers;
+  int32_t worker_count;
+  uint8_t *image;
+  size_t image_len;
+  volatile sig_atomic_t stop;
+};
+
+/* A halo/server value. The one returned by start-server owns the server;
+ * worker threads get their own which only refer to their worker. */
+typedef struct {
+  Server *server;
+  int32_t index;
+  int owner;
+} ServerHandle;
+
+typedef struct Request Request;
+
+/* A halo/connection value, handed to the handler fiber to respond on. The
+ * stream is cleared if the client goes away first. Until then it is on its
+ * worker's pending list, so a handler which fails can be answered for. */
+struct Connection {
+  sb_Stream *stream;
+  Worker *worker;
+  JanetFiber *fiber;
+  Connection *prev;
+  Connection *next;
+  /* A lazy request still reading from the stream, and the copy of the
+   * request it is left with once the stream moves on */
+  Request *request;
+  char *data;
+  sb_Header *headers;
+};
+
+/* A halo/request value: the :lazy-request alternative to the request table,
+ * which makes its fields from the spans sandbird recorded only when they
+ * are looked up. It and its connection mark each other, so neither outlives
+ * the other. */
+struct Request {
+  Connection *conn;
+  unsigned method;
+  sb_Span url;
+  sb_Span body;
+  size_t header_count;
+  JanetTable *fields;
+};
 
-JanetTable *request_table;
-JanetTable *headers;
-Janet prev_header_name;
-JanetFunction *handler;
-http_parser_settings settings;
-sb_Options opt;
-sb_Server *server;
-int server_running = 1;
+volatile sig_atomic_t server_running = 1;
+
+extern const unsigned char *halo_lib_embed;
+extern size_t halo_lib_embed_size;
 
 static void sig_handler(int signo) {
   if (signo == SIGINT) {
@@ -25,7 +102,59 @@ static void sig_handler(int signo) {
 }
 
 
-void send_http_response(sb_Event *e, Janet res) {
+/* Lowercases ASCII letters, leaving every other byte alone; setting 0x20
+ * on token characters such as '_' or '^' would turn them into others */
+#define LOWER(c) ((uint8_t) ((c) >= 'A' && (c) <= 'Z' ? (c) | 0x20 : (c)))
+
+/* Returns nonzero if name is lower, ignoring the case of name */
+static int name_equal(const uint8_t *name, const char *lower) {
+  int32_t len = janet_string_length(name);
+
+  for (int32_t i = 0; i < len; i++) {
+    if (!lower[i] || LOWER(name[i]) != (uint8_t) lower[i]) {
+      return 0;
+    }
+  }
+
+  return lower[len] == '\0';
+}
+
+/* Returns nonzero for the text-like content types compression shrinks */
+static int is_compressible(const uint8_t *type) {
+  static const char *const prefixes[] = {
+    "text/",
+    "application/json",
+    "application/javascript",
+    "application/xml",
+    "image/svg+xml"
+  };
+  int32_t len = janet_string_length(type);
+
+  for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+    size_t n = strlen(prefixes[i]);
+    size_t j = 0;
+    while (j < n && (int32_t) j < len && LOWER(type[j]) == (uint8_t) prefixes[i][j]) {
+      j++;
+    }
+    if (j == n) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* String bodies at least this long are sent from the string itself rather
+ * than copied into the send buffer */
+#define BODY_IN_PLACE_SIZE (16 * 1024)
+
+/* Lets go of a body sandbird has finished sending in place */
+static void release_body(const void *data) {
+  janet_gcunroot(janet_wrap_string((const uint8_t *) data));
+}
+
+
+void send_http_response(sb_Stream *st, Janet res) {
   switch (janet_type(res)) {
       case JANET_TABLE:
       case JANET_STRUCT:
@@ -36,26 +165,23 @@ void send_http_response(sb_Event *e, Janet res) {
 
             /* check for static files */
             const uint8_t *file_path;
-            struct stat s;
             int err;
             Janet janet_filepath = janet_dictionary_get(kvs, kvcap, janet_ckeywordv("file"));
 
             if(janet_checktype(janet_filepath, JANET_STRING)) {
               file_path = janet_unwrap_string(janet_filepath);
-              /* Get file info */
-              err = stat((const char *)file_path, &s);
+
+              /* Handle file; sandbird serves recently sent ones from memory */
+              err = sb_send_file(st, (const char *)file_path);
 
               /* Does file exist? */
-              if (err == -1) {
-                sb_send_status(e->stream, 404, "Not found");
+              if (err == SB_ECANTOPEN) {
+                /* An empty body keeps the connection open for the next request */
+                sb_send_status(st, 404, "Not Found");
+                sb_send_body(st, "", 0, 0, NULL);
                 return;
               }
 
-              // TODO Directories?
-
-              /* Handle file */
-              err = sb_send_file(e->stream, (const char *)file_path);
-
               if (err) {
                 break;
               } else {
@@ -97,7 +223,11 @@ void send_http_response(sb_Event *e, Janet res) {
             }
 
             const char *code_text = http_status_str(code);
-            sb_send_status(e->stream, code, code_text);
+            sb_send_status(st, code, code_text);
+
+            /* Only bodies of a textual type the handler has not encoded
+             * itself are worth compressing */
+            int compressible = 0, encoded = 0;
 
             for (const JanetKV *kv = janet_dictionary_next(headerkvs, headercap, NULL);
                     kv;
@@ -105,166 +235,865 @@ void send_http_response(sb_Event *e, Janet res) {
 
               const uint8_t *name = janet_to_string(kv->key);
 
+              /* sandbird frames the body itself; a second length, or one
+               * which no longer matches once the body is compressed, would
+               * desync the connection */
+              if (name_equal(name, "content-length") ||
+                  name_equal(name, "transfer-encoding")) {
+                continue;
+              }
+
+              if (name_equal(name, "content-type")) {
+                compressible = janet_checktype(kv->value, JANET_STRING) &&
+                               is_compressible(janet_unwrap_string(kv->value));
+              } else if (name_equal(name, "content-encoding")) {
+                encoded = 1;
+              }
+
               int32_t header_len;
                const Janet *header_items;
                if (janet_indexed_view(kv->value, &header_items, &header_len)) {
                  for (int32_t i = 0; i < header_len; i++) {
                    const uint8_t *value = janet_to_string(header_items[i]);
-                   sb_send_header(e->stream, (const char *)name, (const char *)value);
+                   sb_send_header(st, (const char *)name, (const char *)value);
                  }
                } else {
                  const uint8_t *value = janet_to_string(kv->value);
-                 sb_send_header(e->stream, (const char *)name, (const char *)value);
+                 sb_send_header(st, (const char *)name, (const char *)value);
                }
             }
 
-            if (body_len > 0) {
-              int length = snprintf(NULL, 0, "%d", body_len);
-              char str[length];
-
-              sprintf(str, "%d", body_len);
-
-              sb_send_header(e->stream, "Content-Length", str);
-              sb_writef(e->stream, "%s", (const char *)body_bytes);
+            /* Always frame the body so the connection can be kept alive. A
+             * large string cannot change, so it is rooted until sent rather
+             * than copied */
+            sb_Release release = NULL;
+            if (janet_checktype(body, JANET_STRING) && body_len >= BODY_IN_PLACE_SIZE) {
+              janet_gcroot(body);
+              release = release_body;
             }
+            sb_send_body(st, body_bytes, (size_t) body_len, compressible && !encoded, release);
         }
         break;
       default:
-        sb_send_status(e->stream, 500, "Internal server error");
-        sb_send_header(e->stream, "Content-Type", "text/plain");
-        sb_writef(e->stream, "%s", "Internal Server Error");
+        sb_send_status(st, 500, "Internal server error");
+        sb_send_header(st, "Content-Type", "text/plain");
+        sb_writef(st, "%s", "Internal Server Error");
         break;
   }
 }
 
-int message_begin_cb(struct http_parser *parser) {
-  (void)parser;
+static Janet span_string(const char *base, sb_Span span) {
+  return janet_wrap_string(janet_string((const uint8_t *)base + span.idx, span.len));
+}
 
-  return 0;
+/* Common header names, lowercased. A name is looked up by its position in
+ * header_hash_table, a perfect hash of these names, which holds its index
+ * here plus one. */
+static const char *const header_names[] = {
+  "accept", "accept-charset", "accept-encoding", "accept-language",
+  "accept-ranges", "access-control-allow-credentials",
+  "access-control-allow-headers", "access-control-allow-methods",
+  "access-control-allow-origin", "access-control-expose-headers",
+  "access-control-max-age", "access-control-request-headers",
+  "access-control-request-method", "age", "allow", "authorization",
+  "cache-control", "connection", "content-disposition", "content-encoding",
+  "content-language", "content-length", "content-location", "content-range",
+  "content-security-policy", "content-type", "cookie", "date", "dnt", "etag",
+  "expect", "expires", "forwarded", "from", "host", "if-match",
+  "if-modified-since", "if-none-match", "if-range", "if-unmodified-since",
+  "keep-alive", "last-modified", "link", "location", "max-forwards",
+  "origin", "pragma", "priority", "proxy-authorization", "range", "referer",
+  "retry-after", "sec-ch-ua", "sec-ch-ua-mobile", "sec-ch-ua-platform",
+  "sec-fetch-dest", "sec-fetch-mode", "sec-fetch-site", "sec-fetch-user",
+  "sec-websocket-key", "sec-websocket-version", "server", "set-cookie", "te",
+  "trailer", "transfer-encoding", "upgrade", "upgrade-insecure-requests",
+  "user-agent", "vary", "via", "www-authenticate", "x-forwarded-for",
+  "x-forwarded-host", "x-forwarded-proto", "x-real-ip", "x-requested-with"
+};
+
+static const uint8_t header_hash_table[512] = {
+   0,  0, 38,  0,  0,  0, 73,  0,  0,  0,  0, 62,  0,  0,  0,  8,
+  56,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0, 72,  0,  0,  0,  0, 29,  0,  9,  0,  0, 48,  0,
+  22,  0,  0,  0,  0,  0,  0,  0, 58,  0,  6,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0, 47,  0, 39,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0, 69,  0,  0,  0, 68,  0,  0,  0,  0,  0, 71,
+   0,  0,  0,  0,  0,  0, 44,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  4,  0,  0,  0,  0,  0,  0, 24,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 52, 26,  0,
+  61,  0,  0, 17,  0, 34,  0,  0,  0,  0,  0,  3,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 14, 15,  0,  0,  0,  0,
+   0,  0,  0,  0, 12,  0,  0, 10,  0, 37,  0,  0,  0,  0,  0, 51,
+   0,  0,  0, 53,  0,  0,  0, 27,  0,  0, 75,  0,  0, 60,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  1, 30,  0,  0,  0, 35,  0,
+   0,  0,  0,  0, 32,  0,  0, 74,  0,  0,  0, 57,  0,  0, 63,  0,
+  64,  0,  0,  0, 31,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0, 55,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0, 67,  0,  0,  0,  0,  0,  0,  0,  0, 70,  0,  0,  0,
+   0,  0, 54,  0,  0,  0,  0,  0,  0,  0,  0,  0, 18, 36,  0,  0,
+   7,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 28,  0,  0, 76, 33,
+   0,  0,  0,  0,  0,  0,  0,  0, 43,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0, 49,  0,  0,  0, 25,  0,  0, 40,  0,  0, 50,
+   0,  0,  0,  0,  0,  0, 46,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+  23,  0,  0,  0,  0,  0,  0,  0,  0, 45,  0, 13,  0,  0,  0,  0,
+   0, 59,  0,  0, 42,  0,  0,  0,  0,  0,  0,  0,  5,  0,  0, 65,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+  16,  0,  0, 11,  0,  0,  0,  0,  0,  0,  0, 66,  0,  0,  0,  0,
+   0,  0,  0,  0, 77,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0, 21,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 20,  0,
+   0,  0,  0,  0, 41,  0, 19,  0,  0,  2,  0,  0,  0,  0,  0,  0
+};
+
+#define HEADER_NAME_COUNT ((int32_t) (sizeof(header_names) / sizeof(header_names[0])))
+#define HEADER_HASH_SEED 1991u
+
+static const char *const method_names[] = {
+#define XX(num, name, string) #string,
+  HTTP_METHOD_MAP(XX)
+#undef XX
+};
+
+#define METHOD_NAME_COUNT ((int32_t) (sizeof(method_names) / sizeof(method_names[0])))
+
+/* The strings for header_names and method_names, made once for each
+ * thread's VM so requests can share them */
+static JANET_THREAD_LOCAL JanetArray *interned_keys = NULL;
+
+static void intern_keys(void) {
+  if (interned_keys) {
+    return;
+  }
+
+  interned_keys = janet_array(HEADER_NAME_COUNT + METHOD_NAME_COUNT);
+  for (int32_t i = 0; i < HEADER_NAME_COUNT; i++) {
+    janet_array_push(interned_keys, janet_cstringv(header_names[i]));
+  }
+  for (int32_t i = 0; i < METHOD_NAME_COUNT; i++) {
+    janet_array_push(interned_keys, janet_cstringv(method_names[i]));
+  }
+  janet_gcroot(janet_wrap_array(interned_keys));
 }
 
-int header_field_cb(struct http_parser *parser, const char *p, unsigned long len) {
-  (void)parser;
+static Janet header_name(const char *base, sb_Span span) {
+  const uint8_t *name = (const uint8_t *)base + span.idx;
+  uint32_t hash = HEADER_HASH_SEED;
 
-  prev_header_name = janet_wrap_string(janet_string((uint8_t *)p, len));
+  for (size_t i = 0; i < span.len; i++) {
+    hash = (hash ^ LOWER(name[i])) * 16777619u;
+  }
 
-  return 0;
+  int index = header_hash_table[hash >> 23];
+  if (index > 0) {
+    const char *common = header_names[index - 1];
+    size_t i = 0;
+    while (i < span.len && common[i] == LOWER(name[i])) {
+      i++;
+    }
+    if (i == span.len && common[i] == '\0') {
+      return interned_keys->data[index - 1];
+    }
+  }
+
+  uint8_t *lower = janet_string_begin((int32_t) span.len);
+  for (size_t i = 0; i < span.len; i++) {
+    lower[i] = LOWER(name[i]);
+  }
+  return janet_wrap_string(janet_string_end(lower));
 }
 
-int header_value_cb(struct http_parser *parser, const char *p, unsigned long len) {
-  (void)parser;
+static Janet method_name(unsigned method) {
+  if (method < (unsigned) METHOD_NAME_COUNT) {
+    return interned_keys->data[HEADER_NAME_COUNT + method];
+  }
 
-  Janet header = janet_table_get(headers, prev_header_name);
-  Janet value = janet_wrap_string(janet_string((uint8_t *)p, len));
+  return janet_cstringv(http_method_str(method));
+}
+
+/* Puts value under name, collecting repeated names into an array */
+static void put_multi(JanetTable *headers, Janet name, Janet value) {
+  Janet header = janet_table_get(headers, name);
 
   switch (janet_type(header)) {
     case JANET_NIL:
-      janet_table_put(headers, prev_header_name, value);
+      janet_table_put(headers, name, value);
       break;
     case JANET_ARRAY:
       janet_array_push(janet_unwrap_array(header), value);
       break;
     default: {
       Janet newHeader[2] = { header, value };
-      janet_table_put(headers, prev_header_name, janet_wrap_array(janet_array_n(newHeader, 2)));
+      janet_table_put(headers, name, janet_wrap_array(janet_array_n(newHeader, 2)));
       break;
     }
   }
+}
 
-  return 0;
+static JanetTable *build_headers(const char *base, sb_Header *headers, size_t count) {
+  JanetTable *table = janet_table((int32_t) count);
+
+  for (size_t i = 0; i < count; i++) {
+    put_multi(table, header_name(base, headers[i].name), span_string(base, headers[i].value));
+  }
+
+  return table;
 }
 
-int status_cb(struct http_parser *parser, const char *p, unsigned long len) {
-  (void)parser;
-  (void)p;
+/* Returns the first header named name, which must be lowercase, or NULL */
+static const sb_Header *find_header(const char *base, const sb_Header *headers, size_t count, const char *name) {
+  size_t len = strlen(name);
+
+  for (size_t i = 0; i < count; i++) {
+    const char *field = base + headers[i].name.idx;
+    size_t j = 0;
+    if (headers[i].name.len != len) {
+      continue;
+    }
+    while (j < len && LOWER(field[j]) == (uint8_t) name[j]) {
+      j++;
+    }
+    if (j == len) {
+      return &headers[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* Splits the request target into its path and query. Targets
+ * http_parser_parse_url rejects, such as "*", are all path. */
+static void split_url(const char *base, sb_Span url, unsigned method, sb_Span *path, sb_Span *query) {
+  struct http_parser_url u;
+
+  *path = url;
+  query->idx = url.idx + url.len;
+  query->len = 0;
+
+  http_parser_url_init(&u);
+  if (http_parser_parse_url(base + url.idx, url.len, method == HTTP_CONNECT, &u)) {
+    return;
+  }
+
+  if (u.field_set & (1 << UF_PATH)) {
+    path->idx = url.idx + u.field_data[UF_PATH].off;
+    path->len = u.field_data[UF_PATH].len;
+  } else {
+    path->len = 0;
+  }
+
+  if (u.field_set & (1 << UF_QUERY)) {
+    query->idx = url.idx + u.field_data[UF_QUERY].off;
+    query->len = u.field_data[UF_QUERY].len;
+  }
+}
+
+/* Returns the index of the first '%' or '+' in s, or len if there is none */
+static size_t find_escape(const char *s, size_t len) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i percent = _mm_set1_epi8('%');
+  const __m128i plus = _mm_set1_epi8('+');
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(s + i));
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, percent),
+                                              _mm_cmpeq_epi8(chunk, plus)));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  for (; i < len; i++) {
+    if (s[i] == '%' || s[i] == '+') {
+      return i;
+    }
+  }
+
+  return len;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  c = LOWER(c);
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+/* Length of the escape at s[i]: 3 for a valid %XX, otherwise 1 */
+static size_t escape_len(const char *s, size_t len, size_t i) {
+  if (s[i] == '%' && i + 2 < len &&
+      hex_value(s[i + 1]) >= 0 && hex_value(s[i + 2]) >= 0) {
+    return 3;
+  }
+  return 1;
+}
+
+/* Decodes a form-urlencoded component, copying the runs between escapes
+ * whole. A malformed %-escape is kept as it is. */
+static Janet decode_component(const char *s, size_t len) {
+  size_t i = find_escape(s, len);
+
+  if (i == len) {
+    return janet_wrap_string(janet_string((const uint8_t *)s, (int32_t) len));
+  }
+
+  size_t out_len = len;
+  while (i < len) {
+    if (escape_len(s, len, i) == 3) {
+      out_len -= 2;
+      i += 3;
+    } else {
+      i++;
+    }
+    i += find_escape(s + i, len - i);
+  }
+
+  uint8_t *out = janet_string_begin((int32_t) out_len);
+  uint8_t *dst = out;
+  size_t j = 0;
+
+  while (j < len) {
+    size_t run = find_escape(s + j, len - j);
+    memcpy(dst, s + j, run);
+    dst += run;
+    j += run;
+    if (j == len) {
+      break;
+    }
+    if (escape_len(s, len, j) == 3) {
+      *dst++ = (uint8_t) ((hex_value(s[j + 1]) << 4) | hex_value(s[j + 2]));
+      j += 3;
+    } else {
+      *dst++ = s[j] == '+' ? ' ' : '%';
+      j++;
+    }
+  }
+
+  return janet_wrap_string(janet_string_end(out));
+}
+
+/* Parses name=value pairs separated by '&' into a table; repeated names
+ * collect their values into an array */
+static JanetTable *parse_params(const char *s, size_t len) {
+  JanetTable *params = janet_table(0);
+  const char *end = s + len;
+
+  while (s < end) {
+    const char *amp = memchr(s, '&', end - s);
+    const char *pair_end = amp ? amp : end;
+    const char *eq = memchr(s, '=', pair_end - s);
+    const char *name_end = eq ? eq : pair_end;
+
+    if (name_end > s) {
+      Janet value = eq ? decode_component(eq + 1, pair_end - eq - 1) : janet_cstringv("");
+      put_multi(params, decode_component(s, name_end - s), value);
+    }
+    s = pair_end + 1;
+  }
+
+  return params;
+}
+
+static int is_form(const char *base, const sb_Header *headers, size_t count) {
+  static const char form_type[] = "application/x-www-form-urlencoded";
+  const sb_Header *type = find_header(base, headers, count, "content-type");
+  size_t len = sizeof(form_type) - 1;
+
+  if (!type || type->value.len < len) {
+    return 0;
+  }
+
+  const char *value = base + type->value.idx;
+  for (size_t i = 0; i < len; i++) {
+    if (LOWER(value[i]) != (uint8_t) form_type[i]) {
+      return 0;
+    }
+  }
+
+  return type->value.len == len || value[len] == ';' || value[len] == ' ';
+}
+
+static int connection_gc(void *p, size_t len) {
   (void)len;
+  Connection *conn = (Connection *)p;
+
+  if (conn->stream) {
+    conn->stream->udata = NULL;
+  }
+  free(conn->data);
+  free(conn->headers);
 
   return 0;
 }
 
-int url_cb(struct http_parser *parser, const char *p, unsigned long len) {
-  (void)parser;
+static int connection_gcmark(void *p, size_t len) {
+  (void)len;
+  Connection *conn = (Connection *)p;
 
-  janet_table_put(request_table, janet_ckeywordv("uri"), janet_wrap_string(janet_string((const uint8_t *)p, len)));
+  if (conn->request) {
+    janet_mark(janet_wrap_abstract(conn->request));
+  }
+  if (conn->fiber) {
+    janet_mark(janet_wrap_fiber(conn->fiber));
+  }
 
   return 0;
 }
 
-int body_cb(struct http_parser *parser, const char *p, unsigned long len) {
-  (void)parser;
+static const JanetAbstractType connection_type = {
+  "halo/connection",
+  connection_gc,
+  connection_gcmark,
+  JANET_ATEND_GCMARK
+};
 
-  janet_table_put(request_table, janet_ckeywordv("body"), janet_wrap_string(janet_string((const uint8_t *)p, len)));
+/* Lets go of the stream, first copying out the request if a lazy request
+ * may still read from it. If the copy fails its fields read as nil. */
+static void detach_connection(Connection *conn) {
+  sb_Stream *st = conn->stream;
 
-  return 0;
+  if (!st) {
+    return;
+  }
+
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    conn->worker->pending = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  conn->prev = conn->next = NULL;
+
+  if (conn->request) {
+    conn->data = malloc(st->request_len + 1);
+    conn->headers = malloc(st->header_count * sizeof(sb_Header) + 1);
+    if (conn->data && conn->headers) {
+      memcpy(conn->data, st->recv_buf.s, st->request_len);
+      memcpy(conn->headers, st->headers, st->header_count * sizeof(sb_Header));
+    } else {
+      free(conn->data);
+      free(conn->headers);
+      conn->data = NULL;
+      conn->headers = NULL;
+      conn->request->header_count = 0;
+    }
+  }
+
+  st->udata = NULL;
+  conn->stream = NULL;
 }
 
-int headers_complete_cb(http_parser *parser) {
+static const char *request_base(Request *req, sb_Header **headers) {
+  Connection *conn = req->conn;
 
-  janet_table_put(request_table, janet_ckeywordv("method"), janet_wrap_string(janet_cstring(http_method_str(parser->method))));
-  janet_table_put(request_table, janet_ckeywordv("headers"), janet_wrap_table(headers));
+  if (conn->stream) {
+    *headers = conn->stream->headers;
+    return conn->stream->recv_buf.s;
+  }
 
-  return 0;
+  *headers = conn->headers;
+  return conn->data;
+}
+
+/* Makes the field for key, or returns 0 if there is none */
+static int request_field(Request *req, Janet key, Janet *out) {
+  sb_Header *headers;
+  const char *base = request_base(req, &headers);
+
+  if (!base || !janet_checktype(key, JANET_KEYWORD)) {
+    return 0;
+  }
+
+  if (janet_keyeq(key, "uri")) {
+    *out = span_string(base, req->url);
+  } else if (janet_keyeq(key, "method")) {
+    *out = method_name(req->method);
+  } else if (janet_keyeq(key, "headers")) {
+    *out = janet_wrap_table(build_headers(base, headers, req->header_count));
+  } else if (janet_keyeq(key, "body") && req->body.len > 0) {
+    *out = span_string(base, req->body);
+  } else if (janet_keyeq(key, "path") || janet_keyeq(key, "query-string") ||
+             janet_keyeq(key, "query-params")) {
+    sb_Span path, query;
+    split_url(base, req->url, req->method, &path, &query);
+    if (janet_keyeq(key, "path")) {
+      *out = span_string(base, path);
+    } else if (query.len == 0) {
+      return 0;
+    } else if (janet_keyeq(key, "query-string")) {
+      *out = span_string(base, query);
+    } else {
+      *out = janet_wrap_table(parse_params(base + query.idx, query.len));
+    }
+  } else if (janet_keyeq(key, "form-params") && req->body.len > 0 &&
+             is_form(base, headers, req->header_count)) {
+    *out = janet_wrap_table(parse_params(base + req->body.idx, req->body.len));
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+static JanetTable *request_fields(Request *req) {
+  if (!req->fields) {
+    req->fields = janet_table(4);
+  }
+
+  return req->fields;
+}
+
+static int request_get(void *p, Janet key, Janet *out) {
+  Request *req = (Request *)p;
+
+  if (req->fields) {
+    *out = janet_table_get(req->fields, key);
+    if (!janet_checktype(*out, JANET_NIL)) {
+      return 1;
+    }
+  }
+
+  /* Made once, then kept so the same value comes back each time */
+  if (!request_field(req, key, out)) {
+    return 0;
+  }
+  janet_table_put(request_fields(req), key, *out);
+
+  return 1;
+}
+
+static void request_put(void *p, Janet key, Janet value) {
+  janet_table_put(request_fields((Request *)p), key, value);
+}
+
+/* Iterates over the fields, making any not yet looked up */
+static Janet request_next(void *p, Janet key) {
+  Request *req = (Request *)p;
+  const char *names[] = {"uri", "method", "headers", "body", "path",
+                         "query-string", "query-params", "form-params"};
+  Janet value;
+
+  if (janet_checktype(key, JANET_NIL)) {
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+      request_get(req, janet_ckeywordv(names[i]), &value);
+    }
+  }
+
+  return janet_next(janet_wrap_table(request_fields(req)), key);
 }
 
-int message_complete_cb(struct http_parser *parser) {
-  (void)parser;
+static int request_gcmark(void *p, size_t len) {
+  (void)len;
+  Request *req = (Request *)p;
+
+  janet_mark(janet_wrap_abstract(req->conn));
+  if (req->fields) {
+    janet_mark(janet_wrap_table(req->fields));
+  }
 
   return 0;
 }
 
-static int event_handler(sb_Event *e) {
-  if (e->type == SB_EV_REQUEST) {
+static const JanetAbstractType request_type = {
+  "halo/request",
+  NULL,
+  request_gcmark,
+  request_get,
+  request_put,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  request_next,
+  JANET_ATEND_NEXT
+};
 
-    request_table = janet_table(5);
-    headers = janet_table(20);
-    int nparsed = 0;
-    http_parser parser;
-    http_parser_init(&parser, HTTP_REQUEST);
-    nparsed = http_parser_execute(&parser, &settings, e->stream->recv_buf.s, e->stream->recv_buf.len);
+/* Resets a finished fiber from the worker's pool to run the handler, or
+ * makes a new one if there is none. One whose handler raised an error has
+ * finished too. */
+static JanetFiber *take_fiber(Worker *worker, Janet *jarg) {
+  while (worker->fiber_count > 0) {
+    JanetFiber *fiber = worker->fibers[--worker->fiber_count];
+    JanetFiberStatus status = janet_fiber_status(fiber);
+    if ((status == JANET_STATUS_DEAD || status == JANET_STATUS_ERROR) &&
+        janet_fiber_reset(fiber, worker->handler, 2, jarg)) {
+      worker->fiber_hits++;
+      return fiber;
+    }
+  }
+
+  worker->fiber_misses++;
+  return janet_fiber(worker->handler, worker->stack_size, 2, jarg);
+}
+
+/* Returns a fiber to the pool once it has responded; it is only reused if
+ * it has finished by then */
+static void release_fiber(Worker *worker, JanetFiber *fiber) {
+  if (worker->fiber_count < worker->fiber_cap) {
+    worker->fibers[worker->fiber_count++] = fiber;
+  }
+}
 
-    // TODO while loop to parse all the streams
-    // keep calling e->stream->next until NULL
-    // multipart
-    //if(nparsed != e->stream->recv_buf.len) {
-      // parse next stream
-    //}
+/* Answers with a 500 for each handler which finished without responding,
+ * having raised an error, and pools its fiber. The event loop has already
+ * printed the error. */
+static void fail_pending(Worker *worker) {
+  Connection *conn = worker->pending;
+
+  while (conn) {
+    Connection *next = conn->next;
+    JanetFiberStatus status = janet_fiber_status(conn->fiber);
+    if (status == JANET_STATUS_DEAD || status == JANET_STATUS_ERROR) {
+      sb_Stream *st = conn->stream;
+      detach_connection(conn);
+      send_http_response(st, janet_wrap_nil());
+      sb_resume(st);
+      release_fiber(worker, conn->fiber);
+    }
+    conn = next;
+  }
+}
 
-    Janet jarg[1];
-    jarg[0] = janet_wrap_table(request_table);
-    Janet response;
-    JanetFiber *fiber = janet_fiber(handler, 64, 1, jarg);
-    JanetFiber *janet_vm_fiber = janet_current_fiber();
-    if (!janet_vm_fiber->env) {
-        janet_vm_fiber->env = janet_table(0);
+static int event_handler(sb_Event *e) {
+  if (e->type == SB_EV_CLOSE) {
+    /* The handler may still be running; its response is dropped */
+    Connection *conn = e->stream->udata;
+    if (conn) {
+      detach_connection(conn);
     }
-    fiber->env = janet_vm_fiber->env;
-    JanetSignal signal = janet_continue(fiber, jarg[0], &response);
-    if(signal != JANET_SIGNAL_OK) {
-      janet_stacktrace(fiber, response);
-      return SB_RES_CLOSE;
+  } else if (e->type == SB_EV_REQUEST) {
+
+    sb_Stream *st = e->stream;
+    Worker *worker = e->udata;
+    Connection *conn = janet_abstract(&connection_type, sizeof(Connection));
+    conn->stream = st;
+    conn->worker = worker;
+    conn->fiber = NULL;
+    conn->prev = NULL;
+    conn->next = NULL;
+    conn->request = NULL;
+    conn->data = NULL;
+    conn->headers = NULL;
+    st->udata = conn;
+    Janet request;
+
+    if (worker->lazy_request) {
+      Request *req = janet_abstract(&request_type, sizeof(Request));
+      req->conn = conn;
+      req->method = st->parser.method;
+      req->url = st->url;
+      req->body = st->body;
+      req->header_count = st->header_count;
+      req->fields = NULL;
+      conn->request = req;
+      request = janet_wrap_abstract(req);
+    } else {
+      /* sandbird has already parsed the request; build the table from the
+       * spans of recv_buf it recorded */
+      const char *base = st->recv_buf.s;
+      JanetTable *request_table = janet_table(8);
+
+      janet_table_put(request_table, janet_ckeywordv("uri"), span_string(base, st->url));
+      janet_table_put(request_table, janet_ckeywordv("method"), method_name(st->parser.method));
+      janet_table_put(request_table, janet_ckeywordv("headers"),
+                      janet_wrap_table(build_headers(base, st->headers, st->header_count)));
+      if (st->body.len > 0) {
+        janet_table_put(request_table, janet_ckeywordv("body"), span_string(base, st->body));
+      }
+
+      /* Decoding params costs more than most handlers use, so the table
+       * leaves that to halo/parse-params */
+      sb_Span path, query;
+      split_url(base, st->url, st->parser.method, &path, &query);
+      janet_table_put(request_table, janet_ckeywordv("path"), span_string(base, path));
+      if (query.len > 0) {
+        janet_table_put(request_table, janet_ckeywordv("query-string"), span_string(base, query));
+      }
+      request = janet_wrap_table(request_table);
     }
 
-    send_http_response(e, response);
+    /* Run the handler as a fiber of its own on the event loop, so it can
+     * yield without holding up other requests; the response goes out when
+     * it calls respond */
+    sb_suspend(st);
+
+    Janet jarg[2];
+    jarg[0] = janet_wrap_abstract(conn);
+    jarg[1] = request;
+    JanetFiber *fiber = take_fiber(worker, jarg);
+    fiber->env = worker->env;
+    conn->fiber = fiber;
+    conn->next = worker->pending;
+    if (worker->pending) {
+      worker->pending->prev = conn;
+    }
+    worker->pending = conn;
+    janet_schedule(fiber, janet_wrap_nil());
   }
 
   return SB_RES_OK;
 }
 
+static const char *get_option(Janet options, const char *name) {
+  if (janet_checktype(options, JANET_NIL)) {
+    return NULL;
+  }
+
+  Janet value = janet_get(options, janet_ckeywordv(name));
+
+  if (janet_checktype(value, JANET_NIL)) {
+    return NULL;
+  }
+
+  return (const char *)janet_to_string(value);
+}
+
+static void *worker_main(void *arg);
+
+static int32_t get_int_option(Janet options, const char *name, int32_t dflt, int32_t min) {
+  if (janet_checktype(options, JANET_NIL)) {
+    return dflt;
+  }
+
+  Janet value = janet_get(options, janet_ckeywordv(name));
+
+  if (janet_checktype(value, JANET_NIL)) {
+    return dflt;
+  }
+
+  if (!janet_checkint(value) || janet_unwrap_integer(value) < min) {
+    janet_panicf("expected :%s to be an integer of at least %d, got %v", name, min, value);
+  }
+
+  return janet_unwrap_integer(value);
+}
+
+/* Stops the worker threads and closes every worker's server */
+static void server_stop(Server *srv) {
+  if (!srv->workers) {
+    return;
+  }
+
+  srv->stop = 1;
+
+  for (int32_t i = 0; i < srv->worker_count; i++) {
+    Worker *worker = &srv->workers[i];
+    if (worker->started) {
+      pthread_join(worker->thread, NULL);
+    } else if (worker->server) {
+      sb_close_server(worker->server);
+    }
+    free(worker->fibers);
+  }
+
+  free(srv->workers);
+  free(srv->image);
+  srv->workers = NULL;
+  srv->image = NULL;
+}
+
+static Worker *handle_worker(ServerHandle *handle) {
+  Server *srv = handle->server;
+
+  return srv->workers ? &srv->workers[handle->index] : NULL;
+}
+
+static int server_gc(void *p, size_t len) {
+  (void)len;
+  ServerHandle *handle = (ServerHandle *)p;
+
+  if (handle->owner) {
+    server_stop(handle->server);
+    free(handle->server);
+  }
+
+  return 0;
+}
+
+static int server_gcmark(void *p, size_t len) {
+  (void)len;
+  Worker *worker = handle_worker((ServerHandle *)p);
+
+  if (worker) {
+    janet_mark(janet_wrap_function(worker->handler));
+    janet_mark(janet_wrap_table(worker->env));
+    if (worker->stream) {
+      janet_mark(janet_wrap_abstract(worker->stream));
+    }
+    for (int32_t i = 0; i < worker->fiber_count; i++) {
+      janet_mark(janet_wrap_fiber(worker->fibers[i]));
+    }
+    for (Connection *conn = worker->pending; conn; conn = conn->next) {
+      janet_mark(janet_wrap_abstract(conn));
+    }
+  }
+
+  return 0;
+}
+
+static const JanetAbstractType server_type = {
+  "halo/server",
+  server_gc,
+  server_gcmark,
+  JANET_ATEND_GCMARK
+};
+
+static JanetTable *worker_env(void);
+
+/* Marshals the handler so each worker thread can load its own copy. C
+ * functions are written by name, so the handler may only use those from the
+ * core library and halo itself. */
+static void marshal_handler(Server *srv, JanetFunction *janet_handler) {
+  JanetTable *lookup = janet_env_lookup(worker_env());
+  JanetTable *rreg = janet_table(lookup->count);
+  JanetBuffer *image = janet_buffer(0);
+
+  for (int32_t i = 0; i < lookup->capacity; i++) {
+    if (!janet_checktype(lookup->data[i].key, JANET_NIL)) {
+      janet_table_put(rreg, lookup->data[i].value, lookup->data[i].key);
+    }
+  }
+
+  janet_marshal(image, janet_wrap_function(janet_handler), rreg, 0);
+
+  srv->image = malloc(image->count);
+  if (!srv->image) {
+    janet_panicf("failed to intialize server\n");
+  }
+  memcpy(srv->image, image->data, image->count);
+  srv->image_len = image->count;
+}
+
 Janet cfun_start_server(int32_t argc, Janet *argv) {
-  janet_arity(argc, 2, 3);
+  janet_arity(argc, 2, 4);
 
   JanetFunction *janet_handler = janet_getfunction(argv, 0);
   const uint8_t *port = janet_getstring(argv, 1);
-  const uint8_t *ip_address = janet_optstring(argv, argc, 2, NULL);
+  const uint8_t *ip_address = NULL;
+  Janet options = argc > 3 ? argv[3] : janet_wrap_nil();
+  int32_t worker_count = get_int_option(options, "workers", 1, 1);
+  int32_t pool_size = get_int_option(options, "fiber-pool-size", 64, 0);
+  int32_t stack_size = get_int_option(options, "fiber-stack-size", 64, 1);
+  int lazy_request = !janet_checktype(options, JANET_NIL) &&
+                     janet_truthy(janet_get(options, janet_ckeywordv("lazy-request")));
+  sb_Options opt;
+
+  if (argc > 2 && !janet_checktype(argv[2], JANET_NIL)) {
+    ip_address = janet_getstring(argv, 2);
+  }
+
+  intern_keys();
 
-  settings.on_message_begin     = message_begin_cb;
-  settings.on_header_field      = header_field_cb;
-  settings.on_header_value      = header_value_cb;
-  settings.on_status            = status_cb;
-  settings.on_url               = url_cb;
-  settings.on_body              = body_cb;
-  settings.on_headers_complete  = headers_complete_cb;
-  settings.on_message_complete  = message_complete_cb;
+  JanetFiber *janet_vm_fiber = janet_current_fiber();
+  if (!janet_vm_fiber->env) {
+      janet_vm_fiber->env = janet_table(0);
+  }
 
   memset(&opt, 0, sizeof(opt));
 
@@ -272,61 +1101,277 @@ Janet cfun_start_server(int32_t argc, Janet *argv) {
   if(ip_address != NULL) {
     opt.host = (char *)ip_address;
   }
+  opt.keep_alive_timeout = get_option(options, "keep-alive-timeout");
+  opt.max_requests = get_option(options, "max-requests");
+  opt.file_cache_size = get_option(options, "file-cache-size");
+  opt.compress_min_size = get_option(options, "compress-min-size");
+  opt.reuse_port = worker_count > 1 ? "1" : NULL;
   opt.handler = event_handler;
-  handler = janet_handler;
 
-  server = sb_new_server(&opt);
+  ServerHandle *handle = janet_abstract(&server_type, sizeof(ServerHandle));
+  Server *srv = calloc(1, sizeof(Server));
+  handle->server = srv;
+  handle->index = 0;
+  handle->owner = 1;
 
-  if (!server) {
+  if (!srv) {
+    handle->owner = 0;
     janet_panicf("failed to intialize server\n");
   }
 
-  return janet_wrap_nil();
+  srv->worker_count = worker_count;
+  srv->workers = calloc(worker_count, sizeof(Worker));
+
+  if (!srv->workers) {
+    janet_panicf("failed to intialize server\n");
+  }
+
+  srv->workers[0].handler = janet_handler;
+  srv->workers[0].env = janet_vm_fiber->env;
+
+  /* Every listening socket is bound here so a busy port is reported to the
+   * caller rather than from a worker thread */
+  for (int32_t i = 0; i < worker_count; i++) {
+    srv->workers[i].owner = srv;
+    srv->workers[i].stack_size = stack_size;
+    srv->workers[i].lazy_request = lazy_request;
+    srv->workers[i].fiber_cap = pool_size;
+    srv->workers[i].fibers = calloc(pool_size ? pool_size : 1, sizeof(JanetFiber *));
+    opt.udata = &srv->workers[i];
+    srv->workers[i].server = sb_new_server(&opt);
+
+    if (!srv->workers[i].fibers || !srv->workers[i].server) {
+      server_stop(srv);
+      janet_panicf("failed to intialize server\n");
+    }
+  }
+
+  if (worker_count > 1) {
+    marshal_handler(srv, janet_handler);
+
+    for (int32_t i = 1; i < worker_count; i++) {
+      Worker *worker = &srv->workers[i];
+      if (pthread_create(&worker->thread, NULL, worker_main, worker)) {
+        server_stop(srv);
+        janet_panicf("failed to start worker thread\n");
+      }
+      worker->started = 1;
+    }
+  }
+
+  return janet_wrap_abstract(handle);
 }
 
 Janet cfun_poll_server(int32_t argc, Janet *argv) {
+  janet_fixarity(argc, 2);
+
+  Worker *worker = handle_worker(janet_getabstract(argv, 0, &server_type));
+  int32_t timeout = janet_getinteger(argv, 1);
+
+  if (worker) {
+    sb_poll_server(worker->server, timeout);
+    fail_pending(worker);
+  }
+
+  return janet_wrap_nil();
+}
+
+static void wait_callback(JanetFiber *fiber, JanetAsyncEvent event) {
+  switch (event) {
+    case JANET_ASYNC_EVENT_INIT: {
+      /* Streams are edge-triggered, so check for work already waiting */
+      struct pollfd pfd = { fiber->ev_stream->handle, POLLIN, 0 };
+      if (poll(&pfd, 1, 0) <= 0) {
+        break;
+      }
+    }
+    /* fall through */
+    case JANET_ASYNC_EVENT_READ:
+    case JANET_ASYNC_EVENT_HUP:
+    case JANET_ASYNC_EVENT_ERR:
+      janet_schedule(fiber, janet_wrap_true());
+      janet_async_end(fiber);
+      break;
+    case JANET_ASYNC_EVENT_CLOSE:
+      janet_schedule(fiber, janet_wrap_false());
+      janet_async_end(fiber);
+      break;
+    default:
+      break;
+  }
+}
+
+Janet cfun_wait_server(int32_t argc, Janet *argv) {
   janet_fixarity(argc, 1);
 
-  int32_t timeout = janet_getinteger(argv, 0);
+  ServerHandle *handle = janet_getabstract(argv, 0, &server_type);
+  Worker *worker = handle_worker(handle);
+
+  if (!worker || handle->server->stop) {
+    return janet_wrap_false();
+  }
+
+  /* The select() backend has nothing to wait on */
+  int fd = sb_get_server_fd(worker->server);
+  if (fd < 0) {
+    return janet_wrap_nil();
+  }
+
+  /* Janet closes the stream's descriptor, so give it a copy */
+  if (!worker->stream) {
+    int stream_fd = dup(fd);
+    if (stream_fd < 0) {
+      janet_panicf("failed to wait on server\n");
+    }
+    worker->stream = janet_stream(stream_fd, JANET_STREAM_READABLE, NULL);
+  }
 
-  sb_poll_server(server, timeout);
+  janet_async_start(worker->stream, JANET_ASYNC_LISTEN_READ, wait_callback, NULL);
+}
+
+Janet cfun_parse_params(int32_t argc, Janet *argv) {
+  janet_fixarity(argc, 1);
+
+  JanetByteView params = janet_getbytes(argv, 0);
+
+  return janet_wrap_table(parse_params((const char *)params.bytes, (size_t) params.len));
+}
+
+Janet cfun_respond(int32_t argc, Janet *argv) {
+  janet_fixarity(argc, 2);
+
+  Connection *conn = janet_getabstract(argv, 0, &connection_type);
+  sb_Stream *st = conn->stream;
+
+  /* The client may have gone away while the handler ran */
+  if (st) {
+    detach_connection(conn);
+    send_http_response(st, argv[1]);
+    sb_resume(st);
+    release_fiber(conn->worker, janet_current_fiber());
+  }
 
   return janet_wrap_nil();
 }
 
 Janet cfun_server_running(int32_t argc, Janet *argv) {
-  janet_fixarity(argc, 0);
-  (void)argv;
+  janet_arity(argc, 0, 1);
+
+  if (argc > 0) {
+    ServerHandle *handle = janet_getabstract(argv, 0, &server_type);
+    if (!handle_worker(handle) || handle->server->stop) {
+      return janet_wrap_false();
+    }
+  }
 
   return janet_wrap_boolean(server_running);
 }
 
 
 Janet cfun_stop_server(int32_t argc, Janet *argv) {
-  janet_fixarity(argc, 0);
-  (void)argv;
+  janet_fixarity(argc, 1);
+
+  ServerHandle *handle = janet_getabstract(argv, 0, &server_type);
+  Worker *worker = handle_worker(handle);
+
+  /* Wakes any fiber in wait-server */
+  if (worker && worker->stream) {
+    janet_stream_close(worker->stream);
+    worker->stream = NULL;
+  }
 
-  sb_close_server(server);
+  if (handle->owner) {
+    server_stop(handle->server);
+  }
 
   return janet_wrap_nil();
 }
 
+Janet cfun_server_stats(int32_t argc, Janet *argv) {
+  janet_fixarity(argc, 1);
+
+  ServerHandle *handle = janet_getabstract(argv, 0, &server_type);
+  Worker *worker = handle_worker(handle);
+  JanetTable *stats = janet_table(3);
+
+  if (worker) {
+    janet_table_put(stats, janet_ckeywordv("fiber-pool-hits"), janet_wrap_number((double) worker->fiber_hits));
+    janet_table_put(stats, janet_ckeywordv("fiber-pool-misses"), janet_wrap_number((double) worker->fiber_misses));
+    janet_table_put(stats, janet_ckeywordv("fiber-pool-size"), janet_wrap_integer(worker->fiber_count));
+  }
+
+  return janet_wrap_table(stats);
+}
+
 static const JanetReg cfuns[] = {
     {"start-server", cfun_start_server, NULL},
     {"poll-server", cfun_poll_server, NULL},
     {"stop-server", cfun_stop_server, NULL},
+    {"wait-server", cfun_wait_server, NULL},
+    {"respond", cfun_respond, NULL},
+    {"parse-params", cfun_parse_params, NULL},
     {"server-running?", cfun_server_running, NULL},
+    {"server-stats", cfun_server_stats, NULL},
+    {"router", cfun_router, NULL},
+    {"route", cfun_route, NULL},
     {NULL, NULL, NULL}
 };
 
-extern const unsigned char *halo_lib_embed;
-extern size_t halo_lib_embed_size;
+/* The environment a worker's handler is loaded into */
+static JanetTable *worker_env(void) {
+  JanetTable *env = janet_table(0);
+  env->proto = janet_core_env(NULL);
+  janet_cfuns(env, "halo", cfuns);
+  return env;
+}
+
+static void *worker_main(void *arg) {
+  Worker *worker = arg;
+  Janet serve;
+
+  janet_init();
+  janet_register_abstract_type(&router_type);
+  intern_keys();
+
+  worker->env = worker_env();
+  janet_gcroot(janet_wrap_table(worker->env));
+  janet_dobytes(worker->env, halo_lib_embed, halo_lib_embed_size, "halo_lib.janet", NULL);
+  janet_resolve(worker->env, janet_csymbol("serve"), &serve);
+
+  Janet handler = janet_unmarshal(worker->owner->image,
+                                  worker->owner->image_len, 0,
+                                  janet_env_lookup(worker->env), NULL);
+  worker->handler = janet_unwrap_function(handler);
+  janet_gcroot(handler);
+
+  /* Serve from this thread's event loop until the server is stopped */
+  ServerHandle *handle = janet_abstract(&server_type, sizeof(ServerHandle));
+  handle->server = worker->owner;
+  handle->index = (int32_t)(worker - worker->owner->workers);
+  handle->owner = 0;
+
+  Janet jarg[1];
+  jarg[0] = janet_wrap_abstract(handle);
+  JanetFiber *fiber = janet_fiber(janet_unwrap_function(serve), worker->stack_size, 1, jarg);
+  fiber->env = worker->env;
+  janet_schedule(fiber, janet_wrap_nil());
+  janet_loop();
+
+  sb_close_server(worker->server);
+  worker->server = NULL;
+
+  janet_deinit();
+  interned_keys = NULL;
+
+  return NULL;
+}
 
 JANET_MODULE_ENTRY(JanetTable *env) {
     if (signal(SIGINT, sig_handler) == SIG_ERR) {
       printf("\ncan't catch SIGINT\n");
     }
 
+    janet_register_abstract_type(&router_type);
     janet_cfuns(env, "halo", cfuns);
 
     janet_dobytes(env,
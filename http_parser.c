@@ -25,6 +25,17 @@
 #include <string.h>
 #include <limits.h>
 
+/* Vectorised scanning of URLs and header values. The SSE4.2 and AVX2 code is
+ * compiled for its own target and picked at runtime by CPUID, so the parser
+ * still runs on any x86 CPU. Compile with -DHTTP_PARSER_NO_SIMD to build
+ * only the scalar loops.
+ */
+#if !defined(HTTP_PARSER_NO_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+# define HTTP_PARSER_SIMD 1
+# include <immintrin.h>
+#endif
+
 static uint32_t max_header_size = HTTP_MAX_HEADER_SIZE;
 
 #ifndef ULLONG_MAX
@@ -449,6 +460,109 @@ enum http_host_state
 #define start_state (parser->type == HTTP_REQUEST ? s_start_req : s_start_res)
 
 
+/* skip_url_chars() and skip_header_chars() return the first byte in [p, pe)
+ * which may need more than a plain "stay in this state" step: anything but
+ * printable ASCII, plus '?' and '#' in URLs and CR, LF and other controls
+ * in header values. They are allowed to stop early; the byte-at-a-time loop
+ * they sit in front of takes over from wherever they stop.
+ */
+#if HTTP_PARSER_SIMD
+__attribute__((target("avx2")))
+static const char *skip_url_chars_avx2(const char *p, const char *pe) {
+  const __m256i lo = _mm256_set1_epi8(0x20);
+  const __m256i hi = _mm256_set1_epi8(0x7f);
+  const __m256i hash = _mm256_set1_epi8('#');
+  const __m256i question = _mm256_set1_epi8('?');
+
+  for (; pe - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    /* Signed compares, so bytes >= 0x80 fail the first test */
+    __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo),
+                                  _mm256_cmpgt_epi8(hi, v));
+    __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(v, hash),
+                                      _mm256_cmpeq_epi8(v, question));
+    unsigned int stop =
+      ~(unsigned int) _mm256_movemask_epi8(_mm256_andnot_si256(special, ok));
+    if (stop) {
+      return p + __builtin_ctz(stop);
+    }
+  }
+  return p;
+}
+
+__attribute__((target("avx2")))
+static const char *skip_header_chars_avx2(const char *p, const char *pe) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i space = _mm256_set1_epi8(0x20);
+  const __m256i tab = _mm256_set1_epi8(9);
+  const __m256i del = _mm256_set1_epi8(0x7f);
+
+  for (; pe - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    /* Controls are the non-negative bytes below space, bar tab */
+    __m256i ctl = _mm256_andnot_si256(_mm256_cmpgt_epi8(zero, v),
+                                      _mm256_cmpgt_epi8(space, v));
+    __m256i bad = _mm256_or_si256(
+      _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), ctl),
+      _mm256_cmpeq_epi8(v, del));
+    unsigned int stop = (unsigned int) _mm256_movemask_epi8(bad);
+    if (stop) {
+      return p + __builtin_ctz(stop);
+    }
+  }
+  return p;
+}
+
+__attribute__((target("sse4.2")))
+static const char *skip_chars_sse42(const char *p, const char *pe,
+                                    const char *ranges, int nranges) {
+  const __m128i r = _mm_loadu_si128((const __m128i *) ranges);
+
+  for (; pe - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    int i = _mm_cmpestri(r, nranges, v, 16,
+                         _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                         _SIDD_LEAST_SIGNIFICANT);
+    if (i != 16) {
+      return p + i;
+    }
+  }
+  return p;
+}
+#endif
+
+static const char *skip_url_chars(const char *p, const char *pe) {
+#if HTTP_PARSER_SIMD
+  /* Byte ranges which end the run, padded to 16 bytes for the load */
+  static const char ranges[16] = "\000\040##??\177\377";
+
+  if (__builtin_cpu_supports("avx2")) {
+    p = skip_url_chars_avx2(p, pe);
+  } else if (__builtin_cpu_supports("sse4.2")) {
+    p = skip_chars_sse42(p, pe, ranges, 8);
+  }
+#else
+  (void) pe;
+#endif
+  return p;
+}
+
+static const char *skip_header_chars(const char *p, const char *pe) {
+#if HTTP_PARSER_SIMD
+  static const char ranges[16] = "\000\010\012\037\177\177";
+
+  if (__builtin_cpu_supports("avx2")) {
+    p = skip_header_chars_avx2(p, pe);
+  } else if (__builtin_cpu_supports("sse4.2")) {
+    p = skip_chars_sse42(p, pe, ranges, 6);
+  }
+#else
+  (void) pe;
+#endif
+  return p;
+}
+
+
 #if HTTP_PARSER_STRICT
 # define STRICT_CHECK(cond)                                          \
 do {                                                                 \
@@ -1082,6 +1196,15 @@ reexecute:
               SET_ERRNO(HPE_INVALID_URL);
               goto error;
             }
+            if (CURRENT_STATE() == s_req_path ||
+                CURRENT_STATE() == s_req_query_string) {
+              /* Plain URL characters leave these states unchanged, so step
+               * over a run of them at once */
+              size_t left = data + len - (p + 1);
+              const char* start = p + 1;
+              p = skip_url_chars(start, start + MIN(left, max_header_size)) - 1;
+              COUNT_HEADER_SIZE(p + 1 - start);
+            }
         }
         break;
       }
@@ -1500,6 +1623,7 @@ reexecute:
                 size_t left = data + len - p;
                 const char* pe = p + MIN(left, max_header_size);
 
+                p = skip_header_chars(p, pe);
                 for (; p != pe; p++) {
                   ch = *p;
                   if (ch == CR || ch == LF) {
@@ -0,0 +1,432 @@
+#include <stdlib.h>
+#include <string.h>
+#include <janet.h>
+#include "router.h"
+
+#define ROUTER_MAX_PARAMS 32
+
+typedef enum {
+  NODE_STATIC,
+  NODE_PARAM,
+  NODE_WILDCARD
+} NodeType;
+
+/* A route ending at a node, for one method or, if method is NULL, any */
+typedef struct {
+  char *method;
+  int32_t value;     /* Index of the [handler param-names] tuple in values */
+} RouteEntry;
+
+typedef struct RouteNode RouteNode;
+
+/* Static nodes match their prefix exactly; a param node matches one
+ * non-empty segment and a wildcard node the rest of the path. Children are
+ * tried static first, then param, then wildcard. */
+struct RouteNode {
+  NodeType type;
+  char *prefix;
+  size_t len;
+  RouteNode **children;
+  int32_t child_count;
+  RouteNode *param;
+  RouteNode *wildcard;
+  RouteEntry *entries;
+  int32_t entry_count;
+};
+
+typedef struct {
+  RouteNode *root;
+  JanetArray *values;
+  Janet routes;      /* The table it was built from, kept for marshalling */
+} Router;
+
+typedef struct {
+  const char *s;
+  size_t len;
+} Capture;
+
+static void *router_alloc(size_t size) {
+  void *p = calloc(1, size);
+  if (!p) {
+    janet_panicf("out of memory");
+  }
+  return p;
+}
+
+static RouteNode *node_new(NodeType type, const char *prefix, size_t len) {
+  RouteNode *node = calloc(1, sizeof(RouteNode));
+  char *copy = malloc(len + 1);
+  if (!node || !copy) {
+    free(node);
+    free(copy);
+    janet_panicf("out of memory");
+  }
+  node->type = type;
+  node->prefix = copy;
+  memcpy(node->prefix, prefix, len);
+  node->prefix[len] = '\0';
+  node->len = len;
+  return node;
+}
+
+static void node_free(RouteNode *node) {
+  if (!node) {
+    return;
+  }
+
+  for (int32_t i = 0; i < node->child_count; i++) {
+    node_free(node->children[i]);
+  }
+  for (int32_t i = 0; i < node->entry_count; i++) {
+    free(node->entries[i].method);
+  }
+  node_free(node->param);
+  node_free(node->wildcard);
+  free(node->children);
+  free(node->entries);
+  free(node->prefix);
+  free(node);
+}
+
+static void node_add_child(RouteNode *node, RouteNode *child) {
+  RouteNode **children = realloc(node->children, (node->child_count + 1) * sizeof(RouteNode *));
+  if (!children) {
+    node_free(child);
+    janet_panicf("out of memory");
+  }
+  node->children = children;
+  node->children[node->child_count++] = child;
+}
+
+static RouteNode *node_find_child(RouteNode *node, char c) {
+  for (int32_t i = 0; i < node->child_count; i++) {
+    if (node->children[i]->prefix[0] == c) {
+      return node->children[i];
+    }
+  }
+  return NULL;
+}
+
+/* Walks text down from node, splitting prefixes where they diverge, and
+ * returns the node it ends at */
+static RouteNode *insert_static(RouteNode *node, const char *text, size_t len) {
+  while (len > 0) {
+    RouteNode *child = node_find_child(node, text[0]);
+
+    if (!child) {
+      child = node_new(NODE_STATIC, text, len);
+      node_add_child(node, child);
+      return child;
+    }
+
+    size_t common = 0;
+    while (common < len && common < child->len && text[common] == child->prefix[common]) {
+      common++;
+    }
+
+    if (common < child->len) {
+      /* The new node takes the child's place and the child moves below it */
+      RouteNode *split = node_new(NODE_STATIC, child->prefix, common);
+      for (int32_t i = 0; i < node->child_count; i++) {
+        if (node->children[i] == child) {
+          node->children[i] = split;
+        }
+      }
+      memmove(child->prefix, child->prefix + common, child->len - common + 1);
+      child->len -= common;
+      node_add_child(split, child);
+      child = split;
+    }
+
+    node = child;
+    text += common;
+    len -= common;
+  }
+
+  return node;
+}
+
+static void node_add_entry(RouteNode *node, const char *method, int32_t value, Janet key) {
+  for (int32_t i = 0; i < node->entry_count; i++) {
+    const char *existing = node->entries[i].method;
+    if ((!existing && !method) || (existing && method && !strcmp(existing, method))) {
+      janet_panicf("duplicate route %v", key);
+    }
+  }
+
+  RouteEntry *entries = realloc(node->entries, (node->entry_count + 1) * sizeof(RouteEntry));
+  if (!entries) {
+    janet_panicf("out of memory");
+  }
+  node->entries = entries;
+
+  RouteEntry *entry = &node->entries[node->entry_count];
+  entry->method = NULL;
+  if (method) {
+    entry->method = router_alloc(strlen(method) + 1);
+    strcpy(entry->method, method);
+  }
+  entry->value = value;
+  node->entry_count++;
+}
+
+/* Adds the route for pattern. A segment starting with ':' is a parameter
+ * and one starting with '*' takes the rest of the path; both are named by
+ * what follows. */
+static void router_insert(Router *router, const char *method, const uint8_t *pattern,
+                          Janet handler, Janet key) {
+  const char *p = (const char *)pattern;
+  const char *end = p + janet_string_length(pattern);
+  RouteNode *node = router->root;
+  Janet names[ROUTER_MAX_PARAMS];
+  int32_t name_count = 0;
+
+  if (p == end || *p != '/') {
+    janet_panicf("expected route path to start with /, got %v", key);
+  }
+
+  while (p < end) {
+    const char *start = p;
+
+    /* Static text runs up to the next segment starting with ':' or '*' */
+    while (p < end && !(p > start && p[-1] == '/' && (*p == ':' || *p == '*'))) {
+      p++;
+    }
+    node = insert_static(node, start, p - start);
+
+    if (p == end) {
+      break;
+    }
+
+    NodeType type = *p == ':' ? NODE_PARAM : NODE_WILDCARD;
+    const char *name = ++p;
+    while (p < end && *p != '/') {
+      p++;
+    }
+
+    if (p == name) {
+      janet_panicf("expected a name after %c in route %v", name[-1], key);
+    }
+    if (type == NODE_WILDCARD && p < end) {
+      janet_panicf("expected wildcard at the end of route %v", key);
+    }
+    if (name_count == ROUTER_MAX_PARAMS) {
+      janet_panicf("too many parameters in route %v", key);
+    }
+    names[name_count++] = janet_keywordv((const uint8_t *)name, (int32_t) (p - name));
+
+    RouteNode **next = type == NODE_PARAM ? &node->param : &node->wildcard;
+    if (!*next) {
+      *next = node_new(type, "", 0);
+    }
+    node = *next;
+  }
+
+  Janet value[2];
+  value[0] = handler;
+  value[1] = janet_wrap_tuple(janet_tuple_n(names, name_count));
+  janet_array_push(router->values, janet_wrap_tuple(janet_tuple_n(value, 2)));
+  node_add_entry(node, method, router->values->count - 1, key);
+}
+
+static const RouteEntry *node_entry(RouteNode *node, const char *method) {
+  const RouteEntry *any = NULL;
+
+  for (int32_t i = 0; i < node->entry_count; i++) {
+    if (!node->entries[i].method) {
+      any = &node->entries[i];
+    } else if (!strcmp(node->entries[i].method, method)) {
+      return &node->entries[i];
+    }
+  }
+
+  return any;
+}
+
+static const RouteEntry *node_match(RouteNode *node, const char *path, size_t len,
+                                    const char *method, Capture *captures, int32_t depth) {
+  switch (node->type) {
+    case NODE_STATIC:
+      if (len < node->len || memcmp(path, node->prefix, node->len)) {
+        return NULL;
+      }
+      path += node->len;
+      len -= node->len;
+      break;
+
+    case NODE_PARAM: {
+      const char *slash = memchr(path, '/', len);
+      size_t seg = slash ? (size_t) (slash - path) : len;
+      if (seg == 0) {
+        return NULL;
+      }
+      captures[depth].s = path;
+      captures[depth].len = seg;
+      depth++;
+      path += seg;
+      len -= seg;
+      break;
+    }
+
+    case NODE_WILDCARD:
+      captures[depth].s = path;
+      captures[depth].len = len;
+      depth++;
+      path += len;
+      len = 0;
+      break;
+  }
+
+  const RouteEntry *entry = NULL;
+
+  /* A wildcard may also match nothing */
+  if (len == 0) {
+    entry = node_entry(node, method);
+    if (!entry && node->wildcard) {
+      entry = node_match(node->wildcard, path, len, method, captures, depth);
+    }
+    return entry;
+  }
+
+  RouteNode *child = node_find_child(node, path[0]);
+
+  if (child) {
+    entry = node_match(child, path, len, method, captures, depth);
+  }
+  if (!entry && node->param) {
+    entry = node_match(node->param, path, len, method, captures, depth);
+  }
+  if (!entry && node->wildcard) {
+    entry = node_match(node->wildcard, path, len, method, captures, depth);
+  }
+
+  return entry;
+}
+
+static void router_build(Router *router, Janet routes) {
+  const JanetKV *kvs;
+  int32_t len, cap;
+
+  if (!janet_dictionary_view(routes, &kvs, &len, &cap)) {
+    janet_panicf("expected table or struct of routes, got %v", routes);
+  }
+
+  router->root = node_new(NODE_STATIC, "", 0);
+  router->values = janet_array(len);
+  router->routes = routes;
+
+  for (int32_t i = 0; i < cap; i++) {
+    Janet key = kvs[i].key;
+    const Janet *parts;
+    int32_t part_count;
+
+    if (janet_checktype(key, JANET_NIL)) {
+      continue;
+    }
+
+    if (janet_checktype(key, JANET_STRING)) {
+      router_insert(router, NULL, janet_unwrap_string(key), kvs[i].value, key);
+    } else if (janet_indexed_view(key, &parts, &part_count) && part_count == 2 &&
+               janet_checktype(parts[1], JANET_STRING) &&
+               (janet_checktype(parts[0], JANET_STRING) || janet_checktype(parts[0], JANET_NIL))) {
+      const char *method = janet_checktype(parts[0], JANET_NIL)
+                           ? NULL : (const char *)janet_unwrap_string(parts[0]);
+      router_insert(router, method, janet_unwrap_string(parts[1]), kvs[i].value, key);
+    } else {
+      janet_panicf("expected route to be a path or [method path], got %v", key);
+    }
+  }
+}
+
+static int router_gc(void *p, size_t len) {
+  (void)len;
+  Router *router = (Router *)p;
+
+  node_free(router->root);
+
+  return 0;
+}
+
+static int router_gcmark(void *p, size_t len) {
+  (void)len;
+  Router *router = (Router *)p;
+
+  if (router->values) {
+    janet_mark(janet_wrap_array(router->values));
+  }
+  janet_mark(router->routes);
+
+  return 0;
+}
+
+/* Only the route table is written out; the tree is rebuilt on the other
+ * side, which is how handlers using a router reach worker threads */
+static void router_marshal(void *p, JanetMarshalContext *ctx) {
+  janet_marshal_janet(ctx, ((Router *)p)->routes);
+}
+
+static void *router_unmarshal(JanetMarshalContext *ctx) {
+  Router *router = janet_unmarshal_abstract(ctx, sizeof(Router));
+  router->root = NULL;
+  router->values = NULL;
+  router->routes = janet_wrap_nil();
+
+  router_build(router, janet_unmarshal_janet(ctx));
+
+  return router;
+}
+
+const JanetAbstractType router_type = {
+  "halo/router",
+  router_gc,
+  router_gcmark,
+  NULL,
+  NULL,
+  router_marshal,
+  router_unmarshal,
+  JANET_ATEND_UNMARSHAL
+};
+
+Janet cfun_router(int32_t argc, Janet *argv) {
+  janet_fixarity(argc, 1);
+
+  Router *router = janet_abstract(&router_type, sizeof(Router));
+  router->root = NULL;
+  router->values = NULL;
+  router->routes = janet_wrap_nil();
+
+  router_build(router, argv[0]);
+
+  return janet_wrap_abstract(router);
+}
+
+Janet cfun_route(int32_t argc, Janet *argv) {
+  janet_fixarity(argc, 3);
+
+  Router *router = janet_getabstract(argv, 0, &router_type);
+  const char *method = janet_getcstring(argv, 1);
+  JanetByteView path = janet_getbytes(argv, 2);
+  Capture captures[ROUTER_MAX_PARAMS];
+
+  const RouteEntry *entry = node_match(router->root, (const char *)path.bytes,
+                                       (size_t) path.len, method, captures, 0);
+  if (!entry) {
+    return janet_wrap_nil();
+  }
+
+  const Janet *value = janet_unwrap_tuple(router->values->data[entry->value]);
+  const Janet *names = janet_unwrap_tuple(value[1]);
+  int32_t name_count = janet_tuple_length(names);
+  JanetTable *params = janet_table(name_count);
+
+  for (int32_t i = 0; i < name_count; i++) {
+    janet_table_put(params, names[i],
+                    janet_stringv((const uint8_t *)captures[i].s, (int32_t) captures[i].len));
+  }
+
+  Janet result[2];
+  result[0] = value[0];
+  result[1] = janet_wrap_table(params);
+
+  return janet_wrap_tuple(janet_tuple_n(result, 2));
+}
@@ -0,0 +1,13 @@
+#ifndef HALO_ROUTER_H
+#define HALO_ROUTER_H
+
+#include <janet.h>
+
+/* A halo/router value: a radix tree of routes built once from a route table
+ * and matched against request paths in time proportional to their length */
+extern const JanetAbstractType router_type;
+
+Janet cfun_router(int32_t argc, Janet *argv);
+Janet cfun_route(int32_t argc, Janet *argv);
+
+#endif
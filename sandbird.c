@@ -19,18 +19,54 @@
   #include <winsock2.h>
   #include <ws2tcpip.h>
   #include <windows.h>
+  #include <io.h>
+  #include <fcntl.h>
+  #include <sys/stat.h>
 #else
   #ifndef _POSIX_C_SOURCE
     #define _POSIX_C_SOURCE 200809L
   #endif
+  #if defined(__linux__) && !defined(SB_USE_SELECT)
+    #define SB_USE_EPOLL
+  #endif
+  #if defined(SB_USE_IO_URING) && !defined(SB_USE_EPOLL)
+    #undef SB_USE_IO_URING
+  #endif
+  #if defined(SB_USE_IO_URING) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE
+  #endif
+  #ifdef __linux__
+    #define SB_USE_SENDFILE
+    #define SB_USE_INOTIFY
+    #ifndef _DEFAULT_SOURCE
+      #define _DEFAULT_SOURCE /* For SO_REUSEPORT */
+    #endif
+  #endif
   #include <unistd.h>
   #include <fcntl.h>
   #include <netdb.h>
   #include <sys/types.h>
+  #include <sys/stat.h>
   #include <sys/socket.h>
   #include <sys/select.h>
+  #include <sys/uio.h>
   #include <arpa/inet.h>
   #include <netinet/in.h>
+  #ifdef SB_USE_EPOLL
+    #include <sys/epoll.h>
+  #endif
+  #ifdef SB_USE_SENDFILE
+    #include <sys/sendfile.h>
+  #endif
+  #ifdef SB_USE_INOTIFY
+    #include <sys/inotify.h>
+  #endif
+  #ifdef SB_USE_IO_URING
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <poll.h>
+    #include <linux/io_uring.h>
+  #endif
 #endif
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,6 +75,9 @@
 #include <time.h>
 #include <signal.h>
 #include <errno.h>
+#ifdef SB_USE_ZLIB
+  #include <zlib.h>
+#endif
 
 #include "sandbird.h"
 
@@ -70,17 +109,65 @@
   }
 #endif
 
+typedef struct sb_CachedFile sb_CachedFile;
+
+struct sb_CachedFile {
+  sb_CachedFile *next;        /* Next file in the same bucket */
+  sb_CachedFile *lru_prev;    /* More recently sent file */
+  sb_CachedFile *lru_next;    /* Less recently sent file */
+  uint32_t hash;              /* Hash of path */
+  char *path;                 /* Path the file was sent by */
+  char *header;               /* Content and validator header lines */
+  size_t header_len;          /* Length of header */
+  char *data;                 /* Contents of the file */
+  size_t size;                /* Size of the file */
+  time_t mtime;               /* Modification time when it was read */
+  char etag[64];              /* ETag when it was read */
+  time_t checked;             /* Time it was last checked for changes */
+  int wd;                     /* inotify watch on the file, or -1 */
+  int missing;                /* Set if the path does not exist */
+};
+
+typedef struct {
+  sb_CachedFile **buckets;    /* Hash table of files by path */
+  sb_CachedFile *lru_head;    /* Most recently sent file */
+  sb_CachedFile *lru_tail;    /* Least recently sent file */
+  size_t size;                /* Total size of the cached files */
+  size_t max_size;            /* Size the cache is kept within */
+  size_t missing_count;       /* Number of paths cached as missing */
+  int inotify_fd;             /* inotify instance watching them, or -1 */
+} sb_FileCache;
+
 struct sb_Server {
   sb_Stream *streams;         /* Linked list of all streams */
   sb_Handler handler;         /* Event handler callback function */
   sb_Socket sockfd;           /* Listeneing server socket */
   void *udata;                /* User data value passed to all events */
   time_t now;                 /* The current time */
+  char date_header[40];       /* "Date: ...\r\n" line for the current time */
   time_t timeout;             /* Stream no-activity timeout */
   time_t max_lifetime;        /* Maximum time a stream can exist */
   size_t max_request_size;    /* Maximum request size in bytes */
+  time_t keep_alive_timeout;  /* Idle time before a kept-alive stream closes */
+  unsigned max_requests;      /* Maximum requests served per connection */
+  sb_FileCache files;         /* Recently sent files, kept in memory */
+  size_t compress_min_size;   /* Smallest body compressed, or 0 for none */
+#ifdef SB_USE_ZLIB
+  z_stream *deflaters[2];     /* gzip and deflate compressors, kept for reuse */
+#endif
+#ifdef SB_USE_EPOLL
+  int epfd;                   /* epoll instance all sockets are registered on */
+  time_t last_sweep;          /* Time streams were last checked for timeouts */
+#endif
+#ifdef SB_USE_IO_URING
+  struct sb_Uring *uring;     /* io_uring engine, NULL if unavailable */
+#endif
 };
 
+#ifdef SB_USE_EPOLL
+  #define SB_MAX_EVENTS 256
+#endif
+
 enum {
   STATE_RECEIVING_HEADER,
   STATE_RECEIVING_REQUEST,
@@ -91,11 +178,42 @@ enum {
   STATE_CLOSING
 };
 
+enum {
+  STREAM_KEEP_ALIVE = 1 << 0, /* Connection is reused after the response */
+  STREAM_HTTP10     = 1 << 1, /* Request was made with HTTP/1.0 */
+  STREAM_HEAD       = 1 << 2, /* Request was HEAD; no body is sent */
+  STREAM_NO_BODY    = 1 << 3, /* Response status never carries a body */
+  STREAM_LENGTH_SET = 1 << 4, /* Response has a Content-Length header */
+  STREAM_CONN_SET   = 1 << 5, /* Response has a Connection header */
+  STREAM_NO_SENDFILE = 1 << 6, /* sendfile() failed, read the file instead */
+  STREAM_IN_VALUE   = 1 << 7, /* Parser is inside a header value */
+  STREAM_SUSPENDED  = 1 << 8, /* Response will be completed by sb_resume() */
+  STREAM_DATE_SET   = 1 << 9  /* Response has a Date header */
+};
+
 
 /*===========================================================================
  * Utility
  *===========================================================================*/
 
+static int open_file(const char *filename) {
+#ifdef _WIN32
+  return _open(filename, _O_RDONLY | _O_BINARY);
+#else
+  return open(filename, O_RDONLY | O_CLOEXEC);
+#endif
+}
+
+
+static void close_file(int fd) {
+#ifdef _WIN32
+  _close(fd);
+#else
+  close(fd);
+#endif
+}
+
+
 static void set_socket_non_blocking(sb_Socket sockfd) {
 #ifdef _WIN32
   u_long mode = 1;
@@ -176,6 +294,46 @@ static int mem_case_equal(const void *a, const void *b, size_t len) {
 }
 
 
+static size_t uint_to_str(char *dst, unsigned long n) {
+  /* Writes n in decimal, two digits at a time, to dst (which must have room
+   * for 20 digits) and returns the number of digits; no null is written */
+  static const char pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+  char buf[20];
+  char *p = buf + sizeof(buf);
+  while (n >= 100) {
+    unsigned i = (unsigned) (n % 100) * 2;
+    n /= 100;
+    *--p = pairs[i + 1];
+    *--p = pairs[i];
+  }
+  if (n >= 10) {
+    *--p = pairs[n * 2 + 1];
+    *--p = pairs[n * 2];
+  } else {
+    *--p = (char) ('0' + n);
+  }
+  memcpy(dst, p, buf + sizeof(buf) - p);
+  return buf + sizeof(buf) - p;
+}
+
+
+static int has_token(const char *str, const char *token) {
+  /* Checks a comma separated header value for `token` */
+  size_t len = strlen(token);
+  while (*str && *str != '\r') {
+    str += strspn(str, " \t,");
+    if (mem_case_equal(str, token, len) && strchr(" \t,\r", str[len])) {
+      return 1;
+    }
+    str += strcspn(str, ",\r");
+  }
+  return 0;
+}
+
+
 static const char *find_header_value(const char *str, const char *field) {
   size_t len = strlen(field);
   while (*str && !mem_equal(str, "\r\n", 2)) {
@@ -251,9 +409,19 @@ static int sb_buffer_reserve(sb_Buffer *buf, size_t n) {
 }
 
 
+static int sb_buffer_grow(sb_Buffer *buf, size_t n) {
+  /* Makes room for `n` more bytes, at least doubling the capacity so that
+   * repeated appends are amortised */
+  size_t cap = buf->cap ? buf->cap : 64;
+  if (buf->cap - buf->len >= n) return SB_ESUCCESS;
+  while (cap - buf->len < n) cap <<= 1;
+  return sb_buffer_reserve(buf, cap);
+}
+
+
 static int sb_buffer_push_char(sb_Buffer *buf, char chr) {
   if (buf->len == buf->cap) {
-    int err = sb_buffer_reserve(buf, (buf->cap << 1) | (!buf->cap));
+    int err = sb_buffer_grow(buf, 1);
     if (err) return err;
   }
   buf->s[buf->len++] = chr;
@@ -262,16 +430,10 @@ static int sb_buffer_push_char(sb_Buffer *buf, char chr) {
 
 
 static int sb_buffer_push_str(sb_Buffer *buf, const char *p, size_t len) {
-  int err;
-  size_t orig_len = buf->len;
-  while (len) {
-    err = sb_buffer_push_char(buf, *p);
-    if (err) {
-      buf->len = orig_len;
-      return err;
-    }
-    p++, len--;
-  }
+  int err = sb_buffer_grow(buf, len);
+  if (err) return err;
+  memcpy(buf->s + buf->len, p, len);
+  buf->len += len;
   return SB_ESUCCESS;
 }
 
@@ -315,8 +477,12 @@ static int sb_buffer_vwritef(sb_Buffer *buf, const char *fmt, va_list args) {
           if (err) goto fail;
       }
     } else {
-      err = sb_buffer_push_char(buf, *fmt);
+      /* Copy the literal text up to the next format specifier at once */
+      size_t n = strcspn(fmt, "%");
+      err = sb_buffer_push_str(buf, fmt, n);
       if (err) goto fail;
+      fmt += n;
+      continue;
     }
     fmt++;
   }
@@ -348,329 +514,1690 @@ static int sb_buffer_null_terminate(sb_Buffer *buf) {
 
 
 /*===========================================================================
- * Stream
+ * Parser
  *===========================================================================*/
 
-static sb_Stream *sb_stream_new(sb_Server *srv, sb_Socket sockfd) {
-  sb_Stream *st = malloc( sizeof(*st) );
-  if (!st) return NULL;
-  memset(st, 0, sizeof(*st));
-  sb_buffer_init(&st->recv_buf);
-  sb_buffer_init(&st->send_buf);
-  st->sockfd = sockfd;
-  st->server = srv;
-  st->init_time = srv->now;
-  st->last_activity = srv->now;
-  set_socket_non_blocking(sockfd);
-  get_socket_address(sockfd, st->address);
-  return st;
+/* The parser is fed straight from recv_buf; its callbacks only record where
+ * each part of the request lies, so nothing is copied or parsed twice */
+
+static size_t sb_parser_offset(http_parser *p, const char *at) {
+  return at - ((sb_Stream*) p->data)->recv_buf.s;
 }
 
 
-static void sb_stream_close(sb_Stream *st) {
-  st->state = STATE_CLOSING;
+static int sb_parser_on_message_begin(http_parser *p) {
+  sb_Stream *st = p->data;
+  memset(&st->url, 0, sizeof(st->url));
+  memset(&st->body, 0, sizeof(st->body));
+  st->header_count = 0;
+  st->flags &= ~STREAM_IN_VALUE;
+  return 0;
 }
 
 
-static int sb_stream_emit(sb_Stream *st, sb_Event *e) {
-  int res;
-  e->stream = st;
-  e->udata = st->server->udata;
-  e->server = st->server;
-  e->address = st->address;
-  res = e->server->handler(e);
-  if (res < 0) return res;
-  switch (res) {
-    case SB_RES_CLOSE : sb_stream_close(st); /* Fall through */
-    case SB_RES_OK    : return SB_ESUCCESS;
-    default           : return SB_EBADRESULT;
-  }
+static int sb_parser_on_url(http_parser *p, const char *at, size_t len) {
+  sb_Stream *st = p->data;
+  if (st->url.len == 0) st->url.idx = sb_parser_offset(p, at);
+  st->url.len += len;
+  return 0;
 }
 
 
-static void sb_stream_destroy(sb_Stream *st) {
-  sb_Event e;
-  /* Emit close event */
-  e.type = SB_EV_CLOSE;
-  sb_stream_emit(st, &e);
-  /* Clean up */
-  close(st->sockfd);
-  if (st->send_fp) fclose(st->send_fp);
-  sb_buffer_deinit(&st->recv_buf);
-  sb_buffer_deinit(&st->send_buf);
-  free(st);
+static int sb_parser_on_header_field(http_parser *p, const char *at,
+                                     size_t len) {
+  sb_Stream *st = p->data;
+  sb_Header *h;
+  /* A field following a value (or nothing) starts a new header; otherwise
+   * this continues a field split across two reads */
+  if (st->header_count == 0 || (st->flags & STREAM_IN_VALUE)) {
+    if (st->header_count == st->header_cap) {
+      size_t cap = st->header_cap ? st->header_cap << 1 : 16;
+      h = realloc(st->headers, cap * sizeof(*h));
+      if (!h) return -1;
+      st->headers = h;
+      st->header_cap = cap;
+    }
+    h = &st->headers[st->header_count++];
+    memset(h, 0, sizeof(*h));
+    h->name.idx = sb_parser_offset(p, at);
+    st->flags &= ~STREAM_IN_VALUE;
+  } else {
+    h = &st->headers[st->header_count - 1];
+  }
+  h->name.len += len;
+  return 0;
 }
 
 
-static int sb_stream_recv(sb_Stream *st) {
-  for (;;) {
-    char buf[4096];
-    int err, i, sz;
-
-    /* Receive data */
-    sz = recv(st->sockfd, buf, sizeof(buf) - 1, 0);
-    if (sz <= 0) {
-      /* Disconnected? */
-      if (sz == 0 || errno != EWOULDBLOCK) {
-        sb_stream_close(st);
-      }
-      return SB_ESUCCESS;
-    }
+static int sb_parser_on_header_value(http_parser *p, const char *at,
+                                     size_t len) {
+  sb_Stream *st = p->data;
+  sb_Header *h = &st->headers[st->header_count - 1];
+  if (!(st->flags & STREAM_IN_VALUE)) {
+    h->value.idx = sb_parser_offset(p, at);
+    st->flags |= STREAM_IN_VALUE;
+  }
+  h->value.len += len;
+  return 0;
+}
 
-    /* Update last_activity */
-    st->last_activity = st->server->now;
 
-    /* Write to recv_buf */
-    for (i = 0; i < sz; i++) {
-      err = sb_buffer_push_char(&st->recv_buf, buf[i]);
-      if (err) return err;
+static int sb_parser_on_headers_complete(http_parser *p) {
+  sb_Stream *st = p->data;
+  st->state = STATE_RECEIVING_REQUEST;
+  return 0;
+}
 
-      /* Have we received the whole header? */
-      if (
-        st->state == STATE_RECEIVING_HEADER &&
-        st->recv_buf.len >= 4 &&
-        mem_equal(st->recv_buf.s + st->recv_buf.len - 4, "\r\n\r\n", 4)
-      ) {
-        const char *s;
-        /* Update stream's current state */
-        st->state = STATE_RECEIVING_REQUEST;
-        /* Assure recv_buf is null-terminated */
-        err = sb_buffer_null_terminate(&st->recv_buf);
-        if (err) return err;
-        /* If the header contains the Content-Length field we set the
-         * expected_recv_len and continue writing to the recv_buf, otherwise we
-         * assume the request is complete */
-        s = find_header_value(st->recv_buf.s, "Content-Length");
-        if (s) {
-          st->expected_recv_len = st->recv_buf.len + str_to_uint(s);
-          st->data_idx = st->recv_buf.len;
-        } else {
-          goto handle_request;
-        }
-      }
 
-      /* Have we received all the data we're expecting? */
-      if (st->expected_recv_len == st->recv_buf.len) {
-        /* Handle request */
-        sb_Event e;
-        int n, path_idx;
-        char method[16], path[512], ver[16];
-handle_request:
-        st->state = STATE_SENDING_STATUS;
-        /* Assure recv_buf string is NULL-terminated */
-        err = sb_buffer_null_terminate(&st->recv_buf);
-        if (err) return err;
-        /* Get method, path, version */
-        n = sscanf(st->recv_buf.s, "%15s %n%*s %15s", method, &path_idx, ver);
-        /* Is request line invalid? */
-        if (n != 2 || !mem_equal(ver, "HTTP", 4)) {
-          sb_stream_close(st);
-          return SB_ESUCCESS;
-        }
-        /* Build and emit `request` event */
-        url_decode(path, st->recv_buf.s + path_idx, sizeof(path));
-        e.type = SB_EV_REQUEST;
-        e.method = method;
-        e.path = path;
-        err = sb_stream_emit(st, &e);
-        if (err) return err;
-        /* No more data needs to be received (nor should it exist) */
-        return SB_ESUCCESS;
-      }
-    }
+static int sb_parser_on_body(http_parser *p, const char *at, size_t len) {
+  sb_Stream *st = p->data;
+  size_t idx = sb_parser_offset(p, at);
+  if (st->body.len == 0) {
+    st->body.idx = idx;
+  } else if (idx != st->body.idx + st->body.len) {
+    /* Join the chunks of a chunked body up in place; the chunk framing being
+     * overwritten has already been parsed */
+    memmove(st->recv_buf.s + st->body.idx + st->body.len, at, len);
   }
+  st->body.len += len;
+  return 0;
+}
 
-  return SB_ESUCCESS;
+
+static int sb_parser_on_message_complete(http_parser *p) {
+  /* Stop here so any pipelined request that follows is left unparsed until
+   * this one has been responded to */
+  http_parser_pause(p, 1);
+  return 0;
 }
 
 
-static int sb_stream_send(sb_Stream *st) {
-  if (st->send_buf.len > 0) {
-    int sz;
+static const http_parser_settings sb_parser_settings = {
+  sb_parser_on_message_begin,
+  sb_parser_on_url,
+  NULL,
+  sb_parser_on_header_field,
+  sb_parser_on_header_value,
+  sb_parser_on_headers_complete,
+  sb_parser_on_body,
+  sb_parser_on_message_complete,
+  NULL,
+  NULL
+};
 
-    /* Send data */
-send_data:
-    sz = send(st->sockfd, st->send_buf.s, st->send_buf.len, 0);
-    if (sz <= 0) {
-      /* Disconnected? */
-      if (errno != EWOULDBLOCK) {
-        sb_stream_close(st);
-      }
-      return SB_ESUCCESS;
-    }
 
-    /* Remove sent bytes from buffer */
-    sb_buffer_shift(&st->send_buf, sz);
+/*===========================================================================
+ * Validators
+ *===========================================================================*/
 
-    /* Update last_activity */
-    st->last_activity = st->server->now;
+#define SB_MAX_RANGES 16
+#define SB_MAX_MULTIPART_READ (4 * 1024 * 1024)
 
-  } else if (st->send_fp) {
-    /* Read chunk, write to stream and continue sending */
-    int err = sb_buffer_reserve(&st->send_buf, 8192);
-    if (err) return err;
-    st->send_buf.len = fread(st->send_buf.s, 1, st->send_buf.cap, st->send_fp);
-    if (st->send_buf.len > 0) goto send_data;
+typedef struct {
+  size_t start, end;          /* Byte range, end exclusive */
+} sb_Range;
 
-    /* Reached end of file */
-    fclose(st->send_fp);
-    st->send_fp = NULL;
+/* Writes t as an HTTP date into dst, which must hold 30 bytes */
+static void sb_format_http_date(time_t t, char *dst) {
+  /* Not strftime(), whose names depend on the locale */
+  static const char days[] = "SunMonTueWedThuFriSat";
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  struct tm tm;
+#ifdef _WIN32
+  gmtime_s(&tm, &t);
+#else
+  gmtime_r(&t, &tm);
+#endif
+  sprintf(dst, "%.3s, %02d %.3s %04d %02d:%02d:%02d GMT",
+          days + tm.tm_wday * 3, tm.tm_mday, months + tm.tm_mon * 3,
+          tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
 
-  } else {
-    /* No more data left -- disconnect */
-    sb_stream_close(st);
+
+/* Parses an HTTP date in the preferred IMF-fixdate form; returns zero if
+ * str is not one */
+static int sb_parse_http_date(const char *str, time_t *t) {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char mon[4];
+  const char *m;
+  int day, year, hour, min, sec, month;
+  long era, yoe, doy, doe;
+
+  if (sscanf(str, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT",
+             &day, mon, &year, &hour, &min, &sec) != 6) {
+    return 0;
   }
+  m = strstr(months, mon);
+  if (strlen(mon) != 3 || !m || (m - months) % 3) return 0;
+  month = (m - months) / 3 + 1;
+
+  /* Days since the epoch for the civil date */
+  year -= month <= 2;
+  era = (year >= 0 ? year : year - 399) / 400;
+  yoe = year - era * 400;
+  doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+  *t = (time_t) (era * 146097 + doe - 719468) * 86400 +
+       hour * 3600 + min * 60 + sec;
+  return 1;
+}
 
-  return SB_ESUCCESS;
+
+/* Writes the ETag for a file, from its inode, size and mtime, into dst,
+ * which must hold 64 bytes */
+static void sb_file_etag(const struct stat *s, char *dst) {
+  sprintf(dst, "\"%lx-%lx-%lx\"", (unsigned long) s->st_ino,
+          (unsigned long) s->st_size, (unsigned long) s->st_mtime);
 }
 
 
-static int sb_stream_finalize_header(sb_Stream *st) {
-  int err;
-  if (st->state < STATE_SENDING_HEADER) {
-    err = sb_send_status(st, 200, "OK");
-    if (err) return err;
+static int sb_etag_matches(const char *list, const char *etag) {
+  size_t len = strlen(etag);
+  while (*list) {
+    list += strspn(list, " \t,");
+    if (*list == '*') return 1;
+    /* Weak comparison, as for GET */
+    if (list[0] == 'W' && list[1] == '/') list += 2;
+    if (!strncmp(list, etag, len) &&
+        (list[len] == '\0' || strchr(" \t,", list[len]))) {
+      return 1;
+    }
+    list += strcspn(list, ",");
   }
-  err = sb_buffer_push_str(&st->send_buf, "\r\n", 2);
-  if (err) return err;
-  st->state = STATE_SENDING_DATA;
-  return SB_ESUCCESS;
+  return 0;
 }
 
 
-int sb_send_status(sb_Stream *st, int code, const char *msg) {
-  int err;
-  if (st->state != STATE_SENDING_STATUS) {
-    return SB_EBADSTATE;
+/* Returns nonzero if the request has validators, so the client may already
+ * have the file; only a GET or HEAD which hasn't started its response yet
+ * can be answered with a 304 */
+static int sb_stream_conditional(sb_Stream *st) {
+  if (st->state >= STATE_SENDING_HEADER) return 0;
+  if (st->parser.method != HTTP_GET && st->parser.method != HTTP_HEAD) {
+    return 0;
   }
-  err = sb_buffer_writef(&st->send_buf, "HTTP/1.1 %d %s\r\n", code, msg);
-  if (err) return err;
-  st->state = STATE_SENDING_HEADER;
-  return SB_ESUCCESS;
+  return find_header_value(st->recv_buf.s, "If-None-Match") ||
+         find_header_value(st->recv_buf.s, "If-Modified-Since");
 }
 
 
-int sb_send_header(sb_Stream *st, const char *field, const char *val) {
-  int err;
-  if (st->state > STATE_SENDING_HEADER) {
-    return SB_EBADSTATE;
-  }
-  if (st->state < STATE_SENDING_HEADER) {
-    err = sb_send_status(st, 200, "OK");
-    if (err) return err;
+/* Returns nonzero if the client's copy of the file is current. If-None-Match
+ * takes precedence over If-Modified-Since when both are sent. */
+static int sb_stream_not_modified(sb_Stream *st, const char *etag,
+                                  time_t mtime) {
+  char buf[1024];
+  time_t since = 0;
+  int err = sb_get_header(st, "If-None-Match", buf, sizeof(buf));
+  if (err != SB_ENOTFOUND) {
+    return err == SB_ESUCCESS && sb_etag_matches(buf, etag);
   }
-  err = sb_buffer_writef(&st->send_buf, "%s: %s\r\n", field, val);
-  if (err) return err;
-  return SB_ESUCCESS;
+  err = sb_get_header(st, "If-Modified-Since", buf, sizeof(buf));
+  return err == SB_ESUCCESS && sb_parse_http_date(buf, &since) &&
+         mtime <= since;
 }
 
 
-const char *get_filename_ext(const char *filename) {
-  const char *dot = strrchr(filename, '.');
-  if(!dot || dot == filename) return "";
-  return dot + 1;
+/* Returns nonzero if the request's If-Range, if any, names the current
+ * version of the file. Only a strong ETag or the exact Last-Modified date
+ * will do. */
+static int sb_stream_if_range(sb_Stream *st, const char *etag, time_t mtime) {
+  char buf[256];
+  time_t date;
+  int err = sb_get_header(st, "If-Range", buf, sizeof(buf));
+  if (err == SB_ENOTFOUND) return 1;
+  if (err) return 0;
+  if (buf[0] == '"') return strcmp(buf, etag) == 0;
+  return sb_parse_http_date(buf, &date) && date == mtime;
 }
 
 
-int sb_send_file(sb_Stream *st, const char *filename) {
-  int err;
-  char buf[32];
-  size_t sz;
-  FILE *fp = NULL;
-  if (st->state > STATE_SENDING_HEADER) {
-    return SB_EBADSTATE;
+/* Parses the request's Range header for a file of `size` bytes into at most
+ * SB_MAX_RANGES ranges. Returns the number of satisfiable ranges, which is
+ * 0 if there are none, or -1 if the whole file should be sent: when there
+ * is no usable Range header, it is malformed, asks for too many ranges, or
+ * If-Range shows the client has a different version. */
+static int sb_stream_ranges(sb_Stream *st, size_t size, const char *etag,
+                            time_t mtime, sb_Range *ranges) {
+  char buf[512];
+  const char *p;
+  int count = 0;
+
+  if (st->state >= STATE_SENDING_HEADER || st->parser.method != HTTP_GET) {
+    return -1;
   }
-  /* Try to open file */
-  fp = fopen(filename, "rb");
-  if (!fp) return SB_ECANTOPEN;
+  if (sb_get_header(st, "Range", buf, sizeof(buf)) != SB_ESUCCESS ||
+      strncmp(buf, "bytes=", 6) != 0) {
+    return -1;
+  }
+  if (!sb_stream_if_range(st, etag, mtime)) return -1;
 
-  const char *ext = get_filename_ext(filename);
+  p = buf + 6;
+  for (;;) {
+    unsigned long long first = 0, last = 0;
+    int has_first = 0, has_last = 0;
+    char *end;
+
+    p += strspn(p, " \t");
+    if (isdigit((unsigned char) *p)) {
+      first = strtoull(p, &end, 10);
+      p = end;
+      has_first = 1;
+    }
+    if (*p++ != '-') return -1;
+    if (isdigit((unsigned char) *p)) {
+      last = strtoull(p, &end, 10);
+      p = end;
+      has_last = 1;
+    }
+    if (!has_first && !has_last) return -1;
+    if (has_first && has_last && last < first) return -1;
+
+    /* Ranges starting past the end, and empty suffixes, are skipped */
+    if (!has_first) {
+      if (last > 0 && size > 0) {
+        if (count == SB_MAX_RANGES) return -1;
+        ranges[count].start = last < size ? size - last : 0;
+        ranges[count].end = size;
+        count++;
+      }
+    } else if (first < size) {
+      if (count == SB_MAX_RANGES) return -1;
+      ranges[count].start = first;
+      ranges[count].end = has_last && last < size ? last + 1 : size;
+      count++;
+    }
 
-  /* Get file size and write headers */
-  fseek(fp, 0, SEEK_END);
-  sz = ftell(fp);
-  sprintf(buf, "%u", (unsigned) sz);
-  err = sb_send_header(st, "Content-Length", buf);
-  if (err) goto fail;
+    p += strspn(p, " \t");
+    if (*p == '\0') break;
+    if (*p++ != ',') return -1;
+  }
 
-if (strcmp(ext, "js") == 0) {
-  err = sb_send_header(st, "Content-Type", "application/javascript");
-} else if (strcmp(ext, "json") == 0) {
-  err = sb_send_header(st, "Content-Type", "application/json");
-} else if(strcmp(ext, "css") == 0) {
-  err = sb_send_header(st, "Content-Type", "text/css");
-} else if(strcmp(ext, "svg")) {
-  err = sb_send_header(st, "Content-Type", "text/svg");
-} else if(strcmp(ext, "html") == 0) {
-  err = sb_send_header(st, "Content-Type", "text/html");
-} else if(strcmp(ext, "png") == 0) {
-  err = sb_send_header(st, "Content-Type", "image/png");
-} else if(strcmp(ext, "jpg") == 0 || strcmp(ext, "jpeg") == 0) {
-  err = sb_send_header(st, "Content-Type", "image/jpeg");
-} else if(strcmp(ext, "gif") == 0) {
-  err = sb_send_header(st, "Content-Type", "image/gif");
-} else if(strcmp(ext, "ico") == 0) {
-  err = sb_send_header(st, "Content-Type", "image/x-icon");
-} else {
-  err = sb_send_header(st, "Content-Type", "text/plain");
-}
-
-if (err) goto fail;
+  return count;
+}
 
-  err = sb_stream_finalize_header(st);
-  if (err) goto fail;
 
-  /* Rewind file, set stream's fp and state */
-  fseek(fp, 0, SEEK_SET);
-  st->send_fp = fp;
-  st->state = STATE_SENDING_FILE;
-  return SB_ESUCCESS;
+/*===========================================================================
+ * File cache
+ *===========================================================================*/
 
-fail:
-  if (fp) fclose(fp);
-  return err;
+/* Small files are kept in memory along with their headers, so sending one
+ * again makes no filesystem calls. On Linux an inotify watch drops a file
+ * as soon as it changes; elsewhere, or if the watch can't be added, it is
+ * checked with stat() at most once a second.
+ *
+ * Paths which don't exist are kept too, so repeated misses are answered
+ * without a lookup. These are watched through the nearest directory which
+ * does exist, and dropped when anything is created in it. */
+
+#define SB_FILE_CACHE_BUCKETS 256
+#define SB_FILE_CACHE_MAX_MISSING 1024
+
+static uint32_t sb_hash_str(const char *str) {
+  uint32_t hash = 2166136261u;
+  while (*str) {
+    hash = (hash ^ (unsigned char) *str++) * 16777619u;
+  }
+  return hash;
 }
 
 
-int sb_write(sb_Stream *st, const void *data, size_t len) {
-  if (st->state < STATE_SENDING_DATA) {
-    int err = sb_stream_finalize_header(st);
-    if (err) return err;
+static void sb_file_cache_remove(sb_FileCache *fc, sb_CachedFile *f) {
+  sb_CachedFile **link = &fc->buckets[f->hash % SB_FILE_CACHE_BUCKETS];
+  while (*link != f) link = &(*link)->next;
+  *link = f->next;
+
+  if (f->lru_prev) f->lru_prev->lru_next = f->lru_next;
+  else fc->lru_head = f->lru_next;
+  if (f->lru_next) f->lru_next->lru_prev = f->lru_prev;
+  else fc->lru_tail = f->lru_prev;
+
+  fc->size -= f->size;
+  if (f->missing) fc->missing_count--;
+
+#ifdef SB_USE_INOTIFY
+  /* Paths naming the same file share its watch */
+  if (f->wd != -1) {
+    sb_CachedFile *other = fc->lru_head;
+    while (other && other->wd != f->wd) other = other->lru_next;
+    if (!other) inotify_rm_watch(fc->inotify_fd, f->wd);
   }
-  if (st->state != STATE_SENDING_DATA) return SB_EBADSTATE;
-  return sb_buffer_push_str(&st->send_buf, data, len);
+#endif
+
+  free(f);
 }
 
 
-int sb_vwritef(sb_Stream *st, const char *fmt, va_list args) {
-  if (st->state < STATE_SENDING_DATA) {
-    int err = sb_stream_finalize_header(st);
-    if (err) return err;
+static sb_CachedFile *sb_file_cache_get(sb_Server *srv, const char *path) {
+  sb_FileCache *fc = &srv->files;
+  sb_CachedFile *f;
+  uint32_t hash;
+
+  if (!fc->buckets) return NULL;
+
+  hash = sb_hash_str(path);
+  f = fc->buckets[hash % SB_FILE_CACHE_BUCKETS];
+  while (f && (f->hash != hash || strcmp(f->path, path))) f = f->next;
+  if (!f) return NULL;
+
+  if (f->wd == -1 && f->checked != srv->now) {
+    struct stat s;
+    if (f->missing || stat(path, &s) == -1 || s.st_mtime != f->mtime ||
+        (size_t) s.st_size != f->size) {
+      sb_file_cache_remove(fc, f);
+      return NULL;
+    }
+    f->checked = srv->now;
   }
-  if (st->state != STATE_SENDING_DATA) return SB_EBADSTATE;
-  return sb_buffer_vwritef(&st->send_buf, fmt, args);
+
+  /* Move to the front of the LRU list */
+  if (f != fc->lru_head) {
+    f->lru_prev->lru_next = f->lru_next;
+    if (f->lru_next) f->lru_next->lru_prev = f->lru_prev;
+    else fc->lru_tail = f->lru_prev;
+    f->lru_prev = NULL;
+    f->lru_next = fc->lru_head;
+    fc->lru_head->lru_prev = f;
+    fc->lru_head = f;
+  }
+
+  return f;
 }
 
 
-int sb_writef(sb_Stream *st, const char *fmt, ...) {
-  int err;
-  va_list args;
-  va_start(args, fmt);
-  err = sb_vwritef(st, fmt, args);
-  va_end(args);
-  return err;
+static void sb_file_cache_link(sb_FileCache *fc, sb_CachedFile *f) {
+  f->next = fc->buckets[f->hash % SB_FILE_CACHE_BUCKETS];
+  fc->buckets[f->hash % SB_FILE_CACHE_BUCKETS] = f;
+  f->lru_next = fc->lru_head;
+  if (fc->lru_head) fc->lru_head->lru_prev = f;
+  else fc->lru_tail = f;
+  fc->lru_head = f;
+  fc->size += f->size;
 }
 
 
-int sb_get_header(sb_Stream *st, const char *field, char *dst, size_t len) {
-  size_t n;
-  int res = SB_ESUCCESS;
-  const char *s = find_header_value(st->recv_buf.s, field);
-  if (!s) {
-    *dst = '\0';
-    return SB_ENOTFOUND;
+/* Reads the open file `fd` into the cache; returns NULL if it is too big to
+ * keep or can't be read */
+static sb_CachedFile *sb_file_cache_put(sb_Server *srv, const char *path,
+                                        int fd, const struct stat *s,
+                                        const char *etag) {
+  sb_FileCache *fc = &srv->files;
+  sb_CachedFile *f;
+  size_t path_len = strlen(path);
+  size_t size = s->st_size;
+  size_t done = 0;
+  char header[256];
+  char date[30];
+  int header_len;
+
+  if (fc->max_size == 0) return NULL;
+  if (size > fc->max_size / 8) return NULL;
+
+  sb_format_http_date(s->st_mtime, date);
+  header_len = sprintf(header, "Content-Length: %lu\r\n"
+                       "Accept-Ranges: bytes\r\n"
+                       "ETag: %s\r\nLast-Modified: %s\r\n",
+                       (unsigned long) size, etag, date);
+
+  if (!fc->buckets) {
+    fc->buckets = calloc(SB_FILE_CACHE_BUCKETS, sizeof(*fc->buckets));
+    if (!fc->buckets) return NULL;
   }
-  n = strchr(s, '\r') - s;
+
+  /* The path, header and contents are kept in the same block */
+  f = malloc(sizeof(*f) + path_len + 1 + header_len + size);
+  if (!f) return NULL;
+  memset(f, 0, sizeof(*f));
+  f->path = (char *) (f + 1);
+  f->header = f->path + path_len + 1;
+  f->data = f->header + header_len;
+  memcpy(f->path, path, path_len + 1);
+  memcpy(f->header, header, header_len);
+  f->header_len = header_len;
+  f->size = size;
+  f->hash = sb_hash_str(path);
+  f->mtime = s->st_mtime;
+  strcpy(f->etag, etag);
+  f->checked = srv->now;
+  f->wd = -1;
+
+#ifdef SB_USE_INOTIFY
+  /* Watch before reading so no change can be missed. An inode has only one
+   * watch, which other entries may share, so the events are added to it */
+  if (fc->inotify_fd != -1) {
+    f->wd = inotify_add_watch(fc->inotify_fd, path, IN_MASK_ADD | IN_MODIFY |
+                              IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+  }
+#endif
+
+  while (done < size) {
+    ssize_t n = read(fd, f->data + done, size - done);
+    if (n <= 0) {
+#ifdef SB_USE_INOTIFY
+      if (f->wd != -1) {
+        sb_CachedFile *other = fc->lru_head;
+        while (other && other->wd != f->wd) other = other->lru_next;
+        if (!other) inotify_rm_watch(fc->inotify_fd, f->wd);
+      }
+#endif
+      free(f);
+      return NULL;
+    }
+    done += n;
+  }
+
+  /* Make room, dropping the least recently sent files */
+  while (fc->lru_tail && fc->size + size > fc->max_size) {
+    sb_file_cache_remove(fc, fc->lru_tail);
+  }
+
+  sb_file_cache_link(fc, f);
+  return f;
+}
+
+
+/* Records that path does not exist */
+static void sb_file_cache_put_missing(sb_Server *srv, const char *path) {
+  sb_FileCache *fc = &srv->files;
+  sb_CachedFile *f;
+  size_t path_len = strlen(path);
+
+  if (fc->max_size == 0) return;
+
+  if (!fc->buckets) {
+    fc->buckets = calloc(SB_FILE_CACHE_BUCKETS, sizeof(*fc->buckets));
+    if (!fc->buckets) return;
+  }
+
+  /* Keep within the limit by dropping the least recently missed path */
+  if (fc->missing_count >= SB_FILE_CACHE_MAX_MISSING) {
+    sb_CachedFile *old = fc->lru_tail;
+    while (!old->missing) old = old->lru_prev;
+    sb_file_cache_remove(fc, old);
+  }
+
+  f = malloc(sizeof(*f) + path_len + 1);
+  if (!f) return;
+  memset(f, 0, sizeof(*f));
+  f->path = (char *) (f + 1);
+  memcpy(f->path, path, path_len + 1);
+  f->header = f->data = f->path + path_len;
+  f->hash = sb_hash_str(path);
+  f->checked = srv->now;
+  f->missing = 1;
+  f->wd = -1;
+
+#ifdef SB_USE_INOTIFY
+  if (fc->inotify_fd != -1) {
+    /* Walk up to the nearest directory that exists; the watch is on that */
+    char *dir = malloc(path_len + 2);
+    if (dir) {
+      memcpy(dir, path, path_len + 1);
+      for (;;) {
+        char *slash = strrchr(dir, '/');
+        if (!slash) strcpy(dir, ".");
+        else if (slash == dir) dir[1] = '\0';
+        else *slash = '\0';
+        f->wd = inotify_add_watch(fc->inotify_fd, dir, IN_MASK_ADD |
+                                  IN_CREATE | IN_MOVED_TO |
+                                  IN_DELETE_SELF | IN_MOVE_SELF);
+        if (f->wd != -1 || (errno != ENOENT && errno != ENOTDIR) ||
+            !slash || slash == dir) {
+          break;
+        }
+      }
+      free(dir);
+    }
+  }
+#endif
+
+  sb_file_cache_link(fc, f);
+  fc->missing_count++;
+}
+
+
+/* Drops the files which have changed since they were read; called when the
+ * inotify instance is readable */
+static void sb_file_cache_sweep(sb_Server *srv) {
+#ifdef SB_USE_INOTIFY
+  sb_FileCache *fc = &srv->files;
+  union {
+    struct inotify_event ev;
+    char buf[4096];
+  } events;
+  ssize_t n;
+
+  if (fc->inotify_fd == -1) return;
+
+  while ((n = read(fc->inotify_fd, events.buf, sizeof(events.buf))) > 0) {
+    char *p = events.buf;
+    while (p < events.buf + n) {
+      struct inotify_event *ev = (struct inotify_event *) p;
+      sb_CachedFile *f = fc->lru_head;
+      /* A watch can be shared by a file and by misses beneath or beside
+       * it, so every entry on it goes */
+      while (f) {
+        sb_CachedFile *next = f->lru_next;
+        if (f->wd == ev->wd) sb_file_cache_remove(fc, f);
+        f = next;
+      }
+      p += sizeof(*ev) + ev->len;
+    }
+  }
+#else
+  (void) srv;
+#endif
+}
+
+
+static void sb_file_cache_free(sb_FileCache *fc) {
+  while (fc->lru_head) {
+    sb_file_cache_remove(fc, fc->lru_head);
+  }
+  free(fc->buckets);
+  fc->buckets = NULL;
+#ifdef SB_USE_INOTIFY
+  if (fc->inotify_fd != -1) {
+    close(fc->inotify_fd);
+    fc->inotify_fd = -1;
+  }
+#endif
+}
+
+
+/*===========================================================================
+ * Stream
+ *===========================================================================*/
+
+static sb_Stream *sb_stream_new(sb_Server *srv, sb_Socket sockfd) {
+  sb_Stream *st = malloc( sizeof(*st) );
+  if (!st) return NULL;
+  memset(st, 0, sizeof(*st));
+  sb_buffer_init(&st->recv_buf);
+  sb_buffer_init(&st->send_buf);
+  st->sockfd = sockfd;
+  st->send_fd = -1;
+  http_parser_init(&st->parser, HTTP_REQUEST);
+  st->parser.data = st;
+  st->server = srv;
+  st->init_time = srv->now;
+  st->last_activity = srv->now;
+  set_socket_non_blocking(sockfd);
+  get_socket_address(sockfd, st->address);
+  return st;
+}
+
+
+static void sb_stream_close(sb_Stream *st) {
+  st->state = STATE_CLOSING;
+}
+
+
+static int sb_stream_emit(sb_Stream *st, sb_Event *e) {
+  int res;
+  e->stream = st;
+  e->udata = st->server->udata;
+  e->server = st->server;
+  e->address = st->address;
+  res = e->server->handler(e);
+  if (res < 0) return res;
+  switch (res) {
+    case SB_RES_CLOSE : sb_stream_close(st); /* Fall through */
+    case SB_RES_OK    : return SB_ESUCCESS;
+    default           : return SB_EBADRESULT;
+  }
+}
+
+
+static void sb_stream_destroy(sb_Stream *st) {
+  sb_Event e;
+  /* Emit close event */
+  e.type = SB_EV_CLOSE;
+  sb_stream_emit(st, &e);
+  /* Clean up */
+  close(st->sockfd);
+  if (st->send_fd != -1) close_file(st->send_fd);
+  if (st->send_data) st->send_data_release(st->send_data);
+  sb_buffer_deinit(&st->recv_buf);
+  sb_buffer_deinit(&st->send_buf);
+  free(st->headers);
+  free(st);
+}
+
+
+static int sb_stream_finalize_header(sb_Stream *st);
+
+
+static int sb_stream_request_flags(sb_Stream *st) {
+  sb_Server *srv = st->server;
+  http_parser *p = &st->parser;
+  int flags = 0;
+  if (p->method == HTTP_HEAD) flags |= STREAM_HEAD;
+  if (p->http_major == 1 && p->http_minor == 0) flags |= STREAM_HTTP10;
+  /* HTTP/1.0 closes unless the client asks otherwise, HTTP/1.1 the reverse;
+   * an upgraded connection no longer speaks HTTP at all */
+  if (http_should_keep_alive(p) && !p->upgrade) flags |= STREAM_KEEP_ALIVE;
+  if (!srv->keep_alive_timeout ||
+      (srv->max_requests && st->requests >= srv->max_requests)) {
+    flags &= ~STREAM_KEEP_ALIVE;
+  }
+  return flags;
+}
+
+
+static int sb_stream_handle_request(sb_Stream *st) {
+  sb_Event e;
+  int err;
+  char path[512];
+
+  st->state = STATE_SENDING_STATUS;
+  st->request_len = st->parse_idx;
+  /* Assure the request is NULL-terminated; any pipelined data which follows
+   * it has its first byte put back once the request is dropped */
+  if (st->request_len < st->recv_buf.len) {
+    st->request_end = st->recv_buf.s[st->request_len];
+    st->recv_buf.s[st->request_len] = '\0';
+  } else {
+    err = sb_buffer_null_terminate(&st->recv_buf);
+    if (err) return err;
+  }
+  /* A chunked body was joined up in place, so may end before the request */
+  if (st->body.len > 0 && st->body.idx + st->body.len < st->request_len) {
+    st->recv_buf.s[st->body.idx + st->body.len] = '\0';
+  }
+  /* Work out whether the connection can be kept open afterwards */
+  st->requests++;
+  st->flags = sb_stream_request_flags(st);
+  /* Build and emit `request` event */
+  url_decode(path, st->recv_buf.s + st->url.idx, sizeof(path));
+  e.type = SB_EV_REQUEST;
+  e.method = http_method_str(st->parser.method);
+  e.path = path;
+  err = sb_stream_emit(st, &e);
+  if (err) return err;
+  /* Terminate the header block of a response which has no body */
+  if (st->state == STATE_SENDING_HEADER && !(st->flags & STREAM_SUSPENDED)) {
+    err = sb_stream_finalize_header(st);
+    if (err) return err;
+  }
+  return SB_ESUCCESS;
+}
+
+
+static void sb_stream_reset(sb_Stream *st) {
+  /* Drop the handled request, keeping any pipelined data that follows it */
+  if (st->request_len < st->recv_buf.len) {
+    st->recv_buf.s[st->request_len] = st->request_end;
+  }
+  sb_buffer_shift(&st->recv_buf, st->request_len);
+  st->state = STATE_RECEIVING_HEADER;
+  st->flags = 0;
+  st->request_len = 0;
+  st->parse_idx = 0;
+}
+
+
+static int sb_stream_process(sb_Stream *st) {
+  int err;
+
+  /* Handle every complete request in recv_buf in the order it arrived */
+  while (st->state < STATE_SENDING_STATUS) {
+    enum http_errno perr;
+
+    /* Parse only the bytes the parser has not seen yet; it pauses at the end
+     * of each request */
+    if (st->parse_idx == st->recv_buf.len) return SB_ESUCCESS;
+    st->parse_idx += http_parser_execute(
+      &st->parser, &sb_parser_settings,
+      st->recv_buf.s + st->parse_idx, st->recv_buf.len - st->parse_idx);
+    perr = HTTP_PARSER_ERRNO(&st->parser);
+
+    /* Do we need more data? Is the request malformed? */
+    if (perr == HPE_OK) return SB_ESUCCESS;
+    if (perr == HPE_CB_header_field) return SB_EOUTOFMEM;
+    if (perr != HPE_PAUSED) {
+      sb_stream_close(st);
+      return SB_ESUCCESS;
+    }
+    http_parser_pause(&st->parser, 0);
+
+    /* Handle request */
+    err = sb_stream_handle_request(st);
+    if (err) return err;
+
+    /* If the response is already fully queued in send_buf the next pipelined
+     * request can be handled straight away and its response appended */
+    if (
+      st->state != STATE_SENDING_DATA || st->send_fd != -1 ||
+      (st->flags & (STREAM_SUSPENDED | STREAM_KEEP_ALIVE)) != STREAM_KEEP_ALIVE
+    ) {
+      return SB_ESUCCESS;
+    }
+    sb_stream_reset(st);
+  }
+
+  return SB_ESUCCESS;
+}
+
+
+static int sb_stream_wants_send(sb_Stream *st) {
+  /* Pipelined responses may still be queued while the next request is
+   * being received; they are flushed before anything more is read */
+  if (st->state == STATE_CLOSING) return 0;
+  if (st->flags & STREAM_SUSPENDED) return st->send_buf.len > 0;
+  return st->state >= STATE_SENDING_STATUS || st->send_buf.len > 0;
+}
+
+
+static int sb_stream_recv(sb_Stream *st) {
+  for (;;) {
+    size_t from = st->recv_buf.len;
+    int err, sz;
+
+    /* Receive data straight into the spare capacity of recv_buf, leaving
+     * room for a null terminator */
+    err = sb_buffer_grow(&st->recv_buf, 4096);
+    if (err) return err;
+    sz = recv(st->sockfd, st->recv_buf.s + from,
+              st->recv_buf.cap - from - 1, 0);
+    if (sz <= 0) {
+      /* Disconnected? */
+      if (sz == 0 || errno != EWOULDBLOCK) {
+        sb_stream_close(st);
+      }
+      return SB_ESUCCESS;
+    }
+    st->recv_buf.len += sz;
+
+    /* Update last_activity */
+    st->last_activity = st->server->now;
+
+    /* Process data; stop once there is a response to send */
+    err = sb_stream_process(st);
+    if (err) return err;
+    if (st->state == STATE_CLOSING || sb_stream_wants_send(st)) {
+      return SB_ESUCCESS;
+    }
+  }
+
+  return SB_ESUCCESS;
+}
+
+
+static void sb_stream_on_sent(sb_Stream *st, size_t n) {
+  /* Bytes beyond those in send_buf came from send_data, which is handed back
+   * to its owner once it has all gone */
+  size_t buffered = st->send_buf.len - st->send_idx;
+  if (n > buffered) {
+    st->send_data_idx += n - buffered;
+    n = buffered;
+    if (st->send_data_idx == st->send_data_len) {
+      st->send_data_release(st->send_data);
+      st->send_data = NULL;
+    }
+  }
+
+  /* Advance past the sent bytes; the unsent ones are never moved, the buffer
+   * is simply reused from the start once it has been drained */
+  st->send_idx += n;
+  if (st->send_idx == st->send_buf.len) {
+    st->send_buf.len = 0;
+    st->send_idx = 0;
+  }
+
+  /* Update last_activity */
+  st->last_activity = st->server->now;
+}
+
+
+static void sb_stream_on_file_read(sb_Stream *st, int sz) {
+  if (sz > 0) {
+    st->send_offset += sz;
+    st->send_remaining -= sz;
+  } else {
+    /* The file shrank or failed; the client was promised more bytes than it
+     * will get, so the connection cannot be reused */
+    st->flags &= ~STREAM_KEEP_ALIVE;
+    st->send_remaining = 0;
+  }
+  if (st->send_remaining == 0) {
+    close_file(st->send_fd);
+    st->send_fd = -1;
+  }
+}
+
+
+static int sb_stream_read_file(sb_Stream *st) {
+  /* Read the next chunk of the file into send_buf */
+  size_t n;
+  int sz, err = sb_buffer_reserve(&st->send_buf, 8192);
+  if (err) return err;
+  n = st->send_remaining < st->send_buf.cap ?
+      st->send_remaining : st->send_buf.cap;
+#ifdef _WIN32
+  sz = _read(st->send_fd, st->send_buf.s, (unsigned) n);
+#else
+  sz = pread(st->send_fd, st->send_buf.s, n, st->send_offset);
+#endif
+  st->send_buf.len = (sz > 0) ? sz : 0;
+  sb_stream_on_file_read(st, sz);
+  return SB_ESUCCESS;
+}
+
+
+static long sb_stream_write(sb_Stream *st) {
+  /* Sends what is left of send_buf and then of send_data, which on POSIX
+   * systems go out together in one gathered write */
+#ifdef _WIN32
+  if (st->send_buf.len > 0) {
+    return send(st->sockfd, st->send_buf.s + st->send_idx,
+                (int) (st->send_buf.len - st->send_idx), 0);
+  }
+  return send(st->sockfd, st->send_data + st->send_data_idx,
+              (int) (st->send_data_len - st->send_data_idx), 0);
+#else
+  struct iovec iov[2];
+  int n = 0;
+  if (st->send_buf.len > 0) {
+    iov[n].iov_base = st->send_buf.s + st->send_idx;
+    iov[n].iov_len = st->send_buf.len - st->send_idx;
+    n++;
+  }
+  if (st->send_data) {
+    iov[n].iov_base = (void *) (st->send_data + st->send_data_idx);
+    iov[n].iov_len = st->send_data_len - st->send_data_idx;
+    n++;
+  }
+  return writev(st->sockfd, iov, n);
+#endif
+}
+
+
+static int sb_stream_complete(sb_Stream *st) {
+  /* No more data left -- disconnect unless the connection is kept alive and
+   * a complete response was sent */
+  if (!(st->flags & STREAM_KEEP_ALIVE) || st->state < STATE_SENDING_DATA) {
+    sb_stream_close(st);
+    return SB_ESUCCESS;
+  }
+
+  /* Move on to any pipelined request that was already received */
+  sb_stream_reset(st);
+  return sb_stream_process(st);
+}
+
+
+static int sb_stream_send(sb_Stream *st) {
+  for (;;) {
+    if (st->state == STATE_CLOSING) {
+      return SB_ESUCCESS;
+
+    } else if (st->send_buf.len > 0 || st->send_data) {
+      long sz;
+
+      /* Send data */
+      sz = sb_stream_write(st);
+      if (sz <= 0) {
+        /* Disconnected? */
+        if (errno != EWOULDBLOCK) {
+          sb_stream_close(st);
+        }
+        return SB_ESUCCESS;
+      }
+
+      sb_stream_on_sent(st, sz);
+
+      /* Socket is full, wait until it is writable again */
+      if (st->send_buf.len > 0 || st->send_data) return SB_ESUCCESS;
+
+    } else if (st->send_fd != -1) {
+      int err;
+#ifdef SB_USE_SENDFILE
+      /* Send straight from the file to the socket without copying it
+       * through user space */
+      if (!(st->flags & STREAM_NO_SENDFILE)) {
+        off_t off = st->send_offset;
+        ssize_t sz = sendfile(st->sockfd, st->send_fd, &off,
+                              st->send_remaining);
+        if (sz > 0) {
+          sb_stream_on_file_read(st, sz);
+          st->last_activity = st->server->now;
+          /* Socket is full, wait until it is writable again */
+          if (st->send_fd != -1) return SB_ESUCCESS;
+          continue;
+        }
+        if (sz == 0) {
+          sb_stream_on_file_read(st, 0);
+          continue;
+        }
+        if (errno == EWOULDBLOCK) return SB_ESUCCESS;
+        if (errno != EINVAL && errno != ENOSYS) {
+          sb_stream_close(st);
+          return SB_ESUCCESS;
+        }
+        /* Not supported for this file; fall back to reading it */
+        st->flags |= STREAM_NO_SENDFILE;
+      }
+#endif
+      /* Read chunk, write to stream and continue sending */
+      err = sb_stream_read_file(st);
+      if (err) return err;
+
+    } else if (st->flags & STREAM_SUSPENDED) {
+      /* The rest of the response is still to come */
+      return SB_ESUCCESS;
+
+    } else if (st->state >= STATE_SENDING_STATUS) {
+      /* Response sent; this may queue responses to pipelined requests */
+      int err = sb_stream_complete(st);
+      if (err) return err;
+
+    } else {
+      return SB_ESUCCESS;
+    }
+  }
+}
+
+
+static int sb_stream_finalize_header(sb_Stream *st) {
+  int err;
+  if (st->state < STATE_SENDING_HEADER) {
+    err = sb_send_status(st, 200, "OK");
+    if (err) return err;
+  }
+  /* The connection can only be reused if the client can tell where the
+   * response ends */
+  if (!(st->flags & (STREAM_LENGTH_SET | STREAM_NO_BODY | STREAM_HEAD))) {
+    st->flags &= ~STREAM_KEEP_ALIVE;
+  }
+  if (!(st->flags & STREAM_DATE_SET)) {
+    err = sb_buffer_push_str(&st->send_buf, st->server->date_header, 37);
+    if (err) return err;
+  }
+  if (!(st->flags & STREAM_CONN_SET)) {
+    if ((st->flags & STREAM_KEEP_ALIVE) && (st->flags & STREAM_HTTP10)) {
+      err = sb_buffer_push_str(&st->send_buf, "Connection: keep-alive\r\n", 24);
+      if (err) return err;
+    } else if (!(st->flags & (STREAM_KEEP_ALIVE | STREAM_HTTP10))) {
+      err = sb_buffer_push_str(&st->send_buf, "Connection: close\r\n", 19);
+      if (err) return err;
+    }
+  }
+  err = sb_buffer_push_str(&st->send_buf, "\r\n", 2);
+  if (err) return err;
+  st->state = STATE_SENDING_DATA;
+  return SB_ESUCCESS;
+}
+
+
+/* Status lines for the statuses http_parser knows, ready to copy out */
+#define XX(num, name, string) [num] = "HTTP/1.1 " #num " " #string "\r\n",
+static const char *const sb_status_lines[600] = { HTTP_STATUS_MAP(XX) };
+#undef XX
+#define XX(num, name, string) \
+  [num] = sizeof("HTTP/1.1 " #num " " #string "\r\n") - 1,
+static const unsigned char sb_status_line_lens[600] = { HTTP_STATUS_MAP(XX) };
+#undef XX
+
+
+int sb_send_status(sb_Stream *st, int code, const char *msg) {
+  const char *line = NULL;
+  size_t len = 0, msg_len = strlen(msg);
+  char *p;
+  int err;
+  if (st->state != STATE_SENDING_STATUS) {
+    return SB_EBADSTATE;
+  }
+  /* Before queueing a new response behind a partially sent one, drop the
+   * sent bytes if they take up more room than the unsent ones */
+  if (st->send_idx > 0 && st->send_idx >= st->send_buf.len - st->send_idx) {
+    sb_buffer_shift(&st->send_buf, st->send_idx);
+    st->send_idx = 0;
+  }
+  /* The usual reason phrase takes a ready-made line; anything else is put
+   * together here */
+  if (code >= 100 && code < 600 && sb_status_lines[code]) {
+    line = sb_status_lines[code];
+    len = sb_status_line_lens[code];
+    if (len - 15 != msg_len || memcmp(line + 13, msg, msg_len) != 0) {
+      line = NULL;
+    }
+  }
+  if (line) {
+    err = sb_buffer_push_str(&st->send_buf, line, len);
+    if (err) return err;
+  } else {
+    if (code < 0 || code > 999) return SB_EFAILURE;
+    err = sb_buffer_grow(&st->send_buf, msg_len + 15);
+    if (err) return err;
+    p = st->send_buf.s + st->send_buf.len;
+    memcpy(p, "HTTP/1.1 ", 9);
+    p += 9;
+    p += uint_to_str(p, code);
+    *p++ = ' ';
+    memcpy(p, msg, msg_len);
+    p += msg_len;
+    *p++ = '\r';
+    *p++ = '\n';
+    st->send_buf.len = p - st->send_buf.s;
+  }
+  if (code < 200 || code == 204 || code == 304) st->flags |= STREAM_NO_BODY;
+  st->state = STATE_SENDING_HEADER;
+  return SB_ESUCCESS;
+}
+
+
+int sb_send_header(sb_Stream *st, const char *field, const char *val) {
+  size_t field_len, val_len;
+  char *p;
+  int err;
+  if (st->state > STATE_SENDING_HEADER) {
+    return SB_EBADSTATE;
+  }
+  if (st->state < STATE_SENDING_HEADER) {
+    err = sb_send_status(st, 200, "OK");
+    if (err) return err;
+  }
+  field_len = strlen(field);
+  val_len = strlen(val);
+  err = sb_buffer_grow(&st->send_buf, field_len + val_len + 4);
+  if (err) return err;
+  p = st->send_buf.s + st->send_buf.len;
+  memcpy(p, field, field_len);
+  p += field_len;
+  *p++ = ':';
+  *p++ = ' ';
+  memcpy(p, val, val_len);
+  p += val_len;
+  *p++ = '\r';
+  *p++ = '\n';
+  st->send_buf.len = p - st->send_buf.s;
+  /* Track the headers that decide whether the connection can be reused */
+  if (field_len == 14 && mem_case_equal(field, "Content-Length", 14)) {
+    st->flags |= STREAM_LENGTH_SET;
+  } else if (field_len == 4 && mem_case_equal(field, "Date", 4)) {
+    st->flags |= STREAM_DATE_SET;
+  } else if (field_len == 10 && mem_case_equal(field, "Connection", 10)) {
+    st->flags |= STREAM_CONN_SET;
+    if (has_token(val, "close")) st->flags &= ~STREAM_KEEP_ALIVE;
+  }
+  return SB_ESUCCESS;
+}
+
+
+static int sb_send_content_length(sb_Stream *st, size_t len) {
+  char num[21];
+  num[uint_to_str(num, len)] = '\0';
+  return sb_send_header(st, "Content-Length", num);
+}
+
+
+const char *get_filename_ext(const char *filename) {
+  const char *dot = strrchr(filename, '.');
+  if(!dot || dot == filename) return "";
+  return dot + 1;
+}
+
+
+static const char *sb_mime_type(const char *filename) {
+  const char *ext = get_filename_ext(filename);
+
+  if (strcmp(ext, "js") == 0) return "application/javascript";
+  if (strcmp(ext, "json") == 0) return "application/json";
+  if (strcmp(ext, "css") == 0) return "text/css";
+  if (strcmp(ext, "svg") == 0) return "image/svg+xml";
+  if (strcmp(ext, "html") == 0) return "text/html";
+  if (strcmp(ext, "png") == 0) return "image/png";
+  if (strcmp(ext, "jpg") == 0 || strcmp(ext, "jpeg") == 0) return "image/jpeg";
+  if (strcmp(ext, "gif") == 0) return "image/gif";
+  if (strcmp(ext, "ico") == 0) return "image/x-icon";
+  return "text/plain";
+}
+
+
+/* Content codings a file may also be stored in, precompressed beside it
+ * with the given suffix, in order of preference */
+static const struct { const char *name, *suffix; } sb_encodings[] = {
+  { "br",   ".br"  },
+  { "zstd", ".zst" },
+  { "gzip", ".gz"  },
+};
+
+
+/* Returns nonzero if the request's Accept-Encoding allows the coding */
+static int sb_stream_accepts_encoding(sb_Stream *st, const char *coding) {
+  const char *p = find_header_value(st->recv_buf.s, "Accept-Encoding");
+  size_t len = strlen(coding);
+  int star = 0;
+  if (!p) return 0;
+
+  while (*p && *p != '\r') {
+    const char *token, *q;
+    size_t token_len;
+    int accepted = 1;
+
+    p += strspn(p, " \t,");
+    token = p;
+    token_len = strcspn(p, " \t;,\r");
+    p += strcspn(p, ",\r");
+
+    /* A weight of 0 (q=0, q=0.0, ...) refuses the coding */
+    q = memchr(token, ';', p - token);
+    if (q) {
+      q += 1 + strspn(q + 1, " \t");
+      if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+        accepted = strtod(q + 2, NULL) > 0;
+      }
+    }
+
+    if (token_len == len && mem_case_equal(token, coding, len)) {
+      return accepted;
+    }
+    if (token_len == 1 && *token == '*') star = accepted;
+  }
+  return star;
+}
+
+
+/* Writes the headers telling caches the file was negotiated on
+ * Accept-Encoding and, if it was sent precompressed, in which coding */
+static int sb_send_encoding(sb_Stream *st, const char *encoding) {
+  int err;
+  if (encoding) {
+    err = sb_send_header(st, "Content-Encoding", encoding);
+    if (err) return err;
+  }
+  return sb_send_header(st, "Vary", "Accept-Encoding");
+}
+
+
+static int sb_send_cached_file(sb_Stream *st, sb_CachedFile *f,
+                               const char *type, const char *encoding) {
+  int err;
+  if (st->state < STATE_SENDING_HEADER) {
+    err = sb_send_status(st, 200, "OK");
+    if (err) return err;
+  }
+  err = sb_buffer_push_str(&st->send_buf, f->header, f->header_len);
+  if (err) return err;
+  st->flags |= STREAM_LENGTH_SET;
+  err = sb_send_header(st, "Content-Type", type);
+  if (err) return err;
+  err = sb_send_encoding(st, encoding);
+  if (err) return err;
+
+  err = sb_stream_finalize_header(st);
+  if (err) return err;
+
+  /* A HEAD request (or an empty file) only gets the headers */
+  if ((st->flags & STREAM_HEAD) || f->size == 0) {
+    return SB_ESUCCESS;
+  }
+  return sb_buffer_push_str(&st->send_buf, f->data, f->size);
+}
+
+
+static int sb_send_not_modified(sb_Stream *st, const char *etag,
+                                time_t mtime) {
+  int err;
+  char date[30];
+  err = sb_send_status(st, 304, "Not Modified");
+  if (err) return err;
+  err = sb_send_header(st, "ETag", etag);
+  if (err) return err;
+  sb_format_http_date(mtime, date);
+  err = sb_send_header(st, "Last-Modified", date);
+  if (err) return err;
+  err = sb_send_header(st, "Vary", "Accept-Encoding");
+  if (err) return err;
+  return sb_stream_finalize_header(st);
+}
+
+
+/* Appends bytes [start, end) of the file to send_buf, from data if it is
+ * cached or else read from fd */
+static int sb_stream_push_range(sb_Stream *st, const char *data, int fd,
+                                size_t start, size_t end) {
+  int err;
+  if (data) return sb_buffer_push_str(&st->send_buf, data + start, end - start);
+  err = sb_buffer_grow(&st->send_buf, end - start);
+  if (err) return err;
+  while (start < end) {
+    ssize_t n = pread(fd, st->send_buf.s + st->send_buf.len, end - start, start);
+    if (n <= 0) return SB_EFAILURE;
+    st->send_buf.len += n;
+    start += n;
+  }
+  return SB_ESUCCESS;
+}
+
+
+/* Writes the header of one part of a multipart/byteranges body to buf */
+static int sb_format_range_part(char *buf, const char *boundary,
+                                const char *type, const sb_Range *range,
+                                size_t size) {
+  return sprintf(buf, "\r\n--%s\r\nContent-Type: %s\r\n"
+                 "Content-Range: bytes %lu-%lu/%lu\r\n\r\n",
+                 boundary, type, (unsigned long) range->start,
+                 (unsigned long) range->end - 1, (unsigned long) size);
+}
+
+
+/* Sends a 206 response with the given ranges of the file, or a 416 if there
+ * are none. The file's contents are `data` if it is cached, otherwise it is
+ * read from `fd`; a single range from fd is sent by the file sending state,
+ * which then owns fd. */
+static int sb_send_ranges(sb_Stream *st, const sb_Range *ranges, int count,
+                          size_t size, const char *type, const char *encoding,
+                          const char *etag, time_t mtime, const char *data,
+                          int fd) {
+  int err, i;
+  char buf[256];
+  char boundary[24];
+  size_t length;
+
+  if (count == 0) {
+    err = sb_send_status(st, 416, "Range Not Satisfiable");
+    if (err) return err;
+    sprintf(buf, "bytes */%lu", (unsigned long) size);
+    err = sb_send_header(st, "Content-Range", buf);
+    if (err) return err;
+    err = sb_send_header(st, "Content-Length", "0");
+    if (err) return err;
+    return sb_stream_finalize_header(st);
+  }
+
+  err = sb_send_status(st, 206, "Partial Content");
+  if (err) return err;
+  err = sb_send_encoding(st, encoding);
+  if (err) return err;
+  err = sb_send_header(st, "ETag", etag);
+  if (err) return err;
+  sb_format_http_date(mtime, buf);
+  err = sb_send_header(st, "Last-Modified", buf);
+  if (err) return err;
+
+  if (count == 1) {
+    length = ranges[0].end - ranges[0].start;
+    sprintf(buf, "bytes %lu-%lu/%lu", (unsigned long) ranges[0].start,
+            (unsigned long) ranges[0].end - 1, (unsigned long) size);
+    err = sb_send_header(st, "Content-Range", buf);
+    if (err) return err;
+    err = sb_send_header(st, "Content-Type", type);
+    if (err) return err;
+    err = sb_send_content_length(st, length);
+    if (err) return err;
+    err = sb_stream_finalize_header(st);
+    if (err) return err;
+
+    if (data) return sb_stream_push_range(st, data, fd, ranges[0].start, ranges[0].end);
+    st->send_fd = fd;
+    st->send_offset = ranges[0].start;
+    st->send_remaining = length;
+    st->state = STATE_SENDING_FILE;
+    return SB_ESUCCESS;
+  }
+
+  /* Several ranges go in a multipart/byteranges body, whose length is
+   * worked out first so the connection can be kept alive */
+  sprintf(boundary, "%08lx%08lx", (unsigned long) st->server->now,
+          (unsigned long) st->requests ^ (unsigned long) st->sockfd);
+  length = 0;
+  for (i = 0; i < count; i++) {
+    length += sb_format_range_part(buf, boundary, type, &ranges[i], size);
+    length += ranges[i].end - ranges[i].start;
+  }
+  length += sprintf(buf, "\r\n--%s--\r\n", boundary);
+
+  sprintf(buf, "multipart/byteranges; boundary=%s", boundary);
+  err = sb_send_header(st, "Content-Type", buf);
+  if (err) return err;
+  err = sb_send_content_length(st, length);
+  if (err) return err;
+  err = sb_stream_finalize_header(st);
+  if (err) return err;
+
+  for (i = 0; i < count; i++) {
+    sb_format_range_part(buf, boundary, type, &ranges[i], size);
+    err = sb_buffer_push_str(&st->send_buf, buf, strlen(buf));
+    if (err) return err;
+    err = sb_stream_push_range(st, data, fd, ranges[i].start, ranges[i].end);
+    if (err) return err;
+  }
+  return sb_buffer_writef(&st->send_buf, "\r\n--%s--\r\n", boundary);
+}
+
+
+/* Sends the file at path, as a file of the given type stored in the given
+ * content coding (or NULL if it is not encoded). Returns SB_ECANTOPEN
+ * without having sent anything if there is no such regular file. */
+static int sb_send_file_as(sb_Stream *st, const char *filename,
+                           const char *type, const char *encoding) {
+  int err;
+  char etag[64];
+  char date[30];
+  struct stat s;
+  int fd;
+  sb_CachedFile *f;
+  sb_Range ranges[SB_MAX_RANGES];
+  int conditional, count, i;
+  size_t total;
+  conditional = sb_stream_conditional(st);
+
+  /* A cached file is sent from memory */
+  f = sb_file_cache_get(st->server, filename);
+  if (f) {
+    if (f->missing) return SB_ECANTOPEN;
+    if (conditional && sb_stream_not_modified(st, f->etag, f->mtime)) {
+      return sb_send_not_modified(st, f->etag, f->mtime);
+    }
+    count = sb_stream_ranges(st, f->size, f->etag, f->mtime, ranges);
+    if (count >= 0) {
+      return sb_send_ranges(st, ranges, count, f->size, type, encoding,
+                            f->etag, f->mtime, f->data, -1);
+    }
+    return sb_send_cached_file(st, f, type, encoding);
+  }
+
+  /* A client which has the file already is answered without opening it */
+  if (conditional && stat(filename, &s) == 0 && S_ISREG(s.st_mode)) {
+    sb_file_etag(&s, etag);
+    if (sb_stream_not_modified(st, etag, s.st_mtime)) {
+      return sb_send_not_modified(st, etag, s.st_mtime);
+    }
+  }
+
+  /* Try to open file */
+  fd = open_file(filename);
+  if (fd == -1) {
+    if (errno == ENOENT || errno == ENOTDIR) {
+      sb_file_cache_put_missing(st->server, filename);
+    }
+    return SB_ECANTOPEN;
+  }
+
+  /* Get file size, only regular files can be sent */
+  if (fstat(fd, &s) == -1 || !S_ISREG(s.st_mode)) {
+    close_file(fd);
+    return SB_ECANTOPEN;
+  }
+
+  sb_file_etag(&s, etag);
+
+  /* Ranges read from disk; several are only sent if they are small enough
+   * to read into memory */
+  count = sb_stream_ranges(st, s.st_size, etag, s.st_mtime, ranges);
+  total = 0;
+  for (i = 0; i < count; i++) total += ranges[i].end - ranges[i].start;
+  if (count == 0 || count == 1 ||
+      (count > 1 && total <= SB_MAX_MULTIPART_READ)) {
+    err = sb_send_ranges(st, ranges, count, s.st_size, type, encoding, etag,
+                         s.st_mtime, NULL, fd);
+    if (st->state != STATE_SENDING_FILE) close_file(fd);
+    return err;
+  }
+
+  f = sb_file_cache_put(st->server, filename, fd, &s, etag);
+  if (f) {
+    close_file(fd);
+    return sb_send_cached_file(st, f, type, encoding);
+  }
+
+  /* Write headers */
+  err = sb_send_content_length(st, s.st_size);
+  if (err) goto fail;
+  err = sb_send_header(st, "Content-Type", type);
+  if (err) goto fail;
+  err = sb_send_header(st, "Accept-Ranges", "bytes");
+  if (err) goto fail;
+  err = sb_send_encoding(st, encoding);
+  if (err) goto fail;
+  err = sb_send_header(st, "ETag", etag);
+  if (err) goto fail;
+  sb_format_http_date(s.st_mtime, date);
+  err = sb_send_header(st, "Last-Modified", date);
+  if (err) goto fail;
+
+  err = sb_stream_finalize_header(st);
+  if (err) goto fail;
+
+  /* A HEAD request (or an empty file) only gets the headers */
+  if ((st->flags & STREAM_HEAD) || s.st_size == 0) {
+    close_file(fd);
+    return SB_ESUCCESS;
+  }
+
+  /* Set stream's file and state */
+  st->send_fd = fd;
+  st->send_offset = 0;
+  st->send_remaining = s.st_size;
+  st->state = STATE_SENDING_FILE;
+  return SB_ESUCCESS;
+
+fail:
+  close_file(fd);
+  return err;
+}
+
+
+int sb_send_file(sb_Stream *st, const char *filename) {
+  const char *type = sb_mime_type(filename);
+  size_t len = strlen(filename);
+  char path[1024];
+  size_t i;
+  int err;
+  if (st->state > STATE_SENDING_HEADER) {
+    return SB_EBADSTATE;
+  }
+
+  /* Prefer a precompressed copy the client accepts. The file cache keeps
+   * both the copies found and those found missing, so after the first
+   * request the choice costs no system calls */
+  for (i = 0; i < sizeof(sb_encodings) / sizeof(*sb_encodings); i++) {
+    size_t suffix_len = strlen(sb_encodings[i].suffix);
+    if (len + suffix_len >= sizeof(path) ||
+        !sb_stream_accepts_encoding(st, sb_encodings[i].name)) {
+      continue;
+    }
+    memcpy(path, filename, len);
+    memcpy(path + len, sb_encodings[i].suffix, suffix_len + 1);
+    err = sb_send_file_as(st, path, type, sb_encodings[i].name);
+    if (err != SB_ECANTOPEN) return err;
+  }
+
+  return sb_send_file_as(st, filename, type, NULL);
+}
+
+
+int sb_write(sb_Stream *st, const void *data, size_t len) {
+  if (st->state < STATE_SENDING_DATA) {
+    int err = sb_stream_finalize_header(st);
+    if (err) return err;
+  }
+  if (st->state != STATE_SENDING_DATA) return SB_EBADSTATE;
+  if (st->flags & STREAM_HEAD) return SB_ESUCCESS;
+  return sb_buffer_push_str(&st->send_buf, data, len);
+}
+
+
+#ifdef SB_USE_ZLIB
+/* Room left ahead of a compressed body for the header lines that follow it,
+ * which come to at most 151 bytes, and the size it is deflated in steps of */
+#define SB_DEFLATE_GAP   160
+#define SB_DEFLATE_CHUNK (16 * 1024)
+
+/* Sends data as the body, compressed with gzip or, if gzip is zero, deflate.
+ * It is deflated straight into send_buf, behind a gap which the rest of the
+ * header is written into once the compressed length is known. Returns
+ * SB_EFAILURE having sent nothing if it could not be made smaller. */
+static int sb_send_deflated(sb_Stream *st, const void *data, size_t len,
+                            int gzip) {
+  sb_Buffer *buf = &st->send_buf;
+  z_stream **slot = &st->server->deflaters[gzip ? 0 : 1];
+  z_stream *z = *slot;
+  size_t start = buf->len;
+  size_t body, body_len;
+  int err, ret;
+
+  /* The compressor is kept between responses, saving its allocation */
+  if (!z) {
+    z = calloc(1, sizeof(*z));
+    if (!z) return SB_EOUTOFMEM;
+    if (deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, gzip ? 31 : 15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      free(z);
+      return SB_EFAILURE;
+    }
+    *slot = z;
+  } else if (deflateReset(z) != Z_OK) {
+    return SB_EFAILURE;
+  }
+
+  err = sb_buffer_grow(buf, SB_DEFLATE_GAP);
+  if (err) return err;
+  buf->len += SB_DEFLATE_GAP;
+  body = buf->len;
+
+  z->next_in = (Bytef *) data;
+  z->avail_in = (uInt) len;
+  do {
+    size_t avail;
+    err = sb_buffer_grow(buf, SB_DEFLATE_CHUNK);
+    if (err) {
+      buf->len = start;
+      return err;
+    }
+    avail = buf->cap - buf->len;
+    if (avail > 1u << 30) avail = 1u << 30;
+    z->next_out = (Bytef *) buf->s + buf->len;
+    z->avail_out = (uInt) avail;
+    ret = deflate(z, Z_FINISH);
+    buf->len += avail - z->avail_out;
+    /* Stop once it is plain that compressing does not pay */
+    if (buf->len - body >= len) ret = Z_BUF_ERROR;
+  } while (ret == Z_OK);
+
+  body_len = buf->len - body;
+  buf->len = start;
+  if (ret != Z_STREAM_END) return SB_EFAILURE;
+
+  err = sb_send_header(st, "Content-Encoding", gzip ? "gzip" : "deflate");
+  if (err) return err;
+  err = sb_send_header(st, "Vary", "Accept-Encoding");
+  if (err) return err;
+  err = sb_send_content_length(st, body_len);
+  if (err) return err;
+  err = sb_stream_finalize_header(st);
+  if (err) return err;
+
+  /* Close the gap between the header and the body */
+  if (!(st->flags & STREAM_HEAD)) {
+    memmove(buf->s + buf->len, buf->s + body, body_len);
+    buf->len += body_len;
+  }
+  return SB_ESUCCESS;
+}
+#endif
+
+
+/* Sends data as the whole body of the response, with its Content-Length. If
+ * compress is set, the body is at least the server's compress_min_size and
+ * the client accepts it, it is gzip or deflate compressed; whenever compress
+ * is set and compression is enabled the response has Vary: Accept-Encoding,
+ * compressed or not. If release is
+ * given, data is sent from where it is rather than copied, and release(data)
+ * is called once it is no longer needed, which may be straight away. */
+int sb_send_body(sb_Stream *st, const void *data, size_t len, int compress,
+                 sb_Release release) {
+  int err;
+  if (st->state > STATE_SENDING_HEADER) {
+    err = SB_EBADSTATE;
+    goto done;
+  }
+  if (st->state < STATE_SENDING_HEADER) {
+    err = sb_send_status(st, 200, "OK");
+    if (err) goto done;
+  }
+
+  /* Statuses such as 204 and 304 have no body to frame */
+  if (st->flags & STREAM_NO_BODY) {
+    err = sb_stream_finalize_header(st);
+    goto done;
+  }
+
+#ifdef SB_USE_ZLIB
+  if (compress && st->server->compress_min_size) {
+    if (len >= st->server->compress_min_size) {
+      err = SB_EFAILURE;
+      if (sb_stream_accepts_encoding(st, "gzip")) {
+        err = sb_send_deflated(st, data, len, 1);
+      } else if (sb_stream_accepts_encoding(st, "deflate")) {
+        err = sb_send_deflated(st, data, len, 0);
+      }
+      if (err != SB_EFAILURE) goto done;
+    }
+    /* Sent as it is, but caches must still tell it apart from a response
+     * which was compressed */
+    err = sb_send_header(st, "Vary", "Accept-Encoding");
+    if (err) goto done;
+  }
+#else
+  (void) compress;
+#endif
+
+  err = sb_send_content_length(st, len);
+  if (err) goto done;
+
+  /* Like a file, a body sent in place follows send_buf out and nothing
+   * more can be written after it */
+  if (release && len > 0 && !(st->flags & STREAM_HEAD)) {
+    err = sb_stream_finalize_header(st);
+    if (err) goto done;
+    st->send_data = data;
+    st->send_data_len = len;
+    st->send_data_idx = 0;
+    st->send_data_release = release;
+    st->state = STATE_SENDING_FILE;
+    return SB_ESUCCESS;
+  }
+  err = sb_write(st, data, len);
+
+done:
+  if (release) release(data);
+  return err;
+}
+
+
+int sb_vwritef(sb_Stream *st, const char *fmt, va_list args) {
+  if (st->state < STATE_SENDING_DATA) {
+    int err = sb_stream_finalize_header(st);
+    if (err) return err;
+  }
+  if (st->state != STATE_SENDING_DATA) return SB_EBADSTATE;
+  if (st->flags & STREAM_HEAD) return SB_ESUCCESS;
+  return sb_buffer_vwritef(&st->send_buf, fmt, args);
+}
+
+
+int sb_writef(sb_Stream *st, const char *fmt, ...) {
+  int err;
+  va_list args;
+  va_start(args, fmt);
+  err = sb_vwritef(st, fmt, args);
+  va_end(args);
+  return err;
+}
+
+
+int sb_get_header(sb_Stream *st, const char *field, char *dst, size_t len) {
+  size_t n;
+  int res = SB_ESUCCESS;
+  const char *s = find_header_value(st->recv_buf.s, field);
+  if (!s) {
+    *dst = '\0';
+    return SB_ENOTFOUND;
+  }
+  n = strchr(s, '\r') - s;
   while (n > 1 && strchr(" \t", s[n-1])) n--; /* trim whitespace from end */
   if (n > len - 1) {
     n = len - 1;
@@ -682,115 +2209,663 @@ int sb_get_header(sb_Stream *st, const char *field, char *dst, size_t len) {
 }
 
 
-int sb_get_var(sb_Stream *st, const char *name, char *dst, size_t len) {
-  const char *q, *s = NULL;
+int sb_get_var(sb_Stream *st, const char *name, char *dst, size_t len) {
+  const char *q, *s = NULL;
+
+  /* Find beginning of query string */
+  q = st->recv_buf.s + strcspn(st->recv_buf.s, "?\r");
+  q = (*q == '?') ? (q + 1) : NULL;
+
+  /* Try to get var from query string, then data string */
+  if (q) s = find_var_value(q, name);
+  if (!s && st->body.len > 0) {
+    s = find_var_value(st->recv_buf.s + st->body.idx, name);
+  }
+  if (!s) {
+    *dst = '\0';
+    return SB_ENOTFOUND;
+  }
+  return url_decode(dst, s, len);
+}
+
+
+int sb_get_cookie(sb_Stream *st, const char *name, char *dst, size_t len) {
+  size_t n;
+  const char *s = st->recv_buf.s;
+  int res = SB_ESUCCESS;
+  size_t name_len = strlen(name);
+
+  /* Get cookie header */
+  s = find_header_value(st->recv_buf.s, "Cookie");
+  if (!s) goto fail;
+
+  /* Find var */
+  while (*s) {
+    s += strspn(s, " \t");
+    /* Found var? find value, get len, copy value and return */
+    if ( mem_case_equal(s, name, name_len) && strchr(" =", s[name_len]) ) {
+      s += name_len;
+      s += strspn(s, "= \t\r");
+      n = strcspn(s, ";\r");
+      if (n >= len - 1) {
+        n = len - 1;
+        res = SB_ETRUNCATED;
+      }
+      memcpy(dst, s, n);
+      dst[n] = '\0';
+      return res;
+    }
+    s += strcspn(s, ";\r");
+    if (*s != ';') goto fail;
+    s++;
+  }
+
+fail:
+  *dst = '\0';
+  return SB_ENOTFOUND;
+}
+
+
+#define P_ATCHK(x)      do { if (!(p = (x))) goto fail; } while (0)
+#define P_AFTERL(x, l)  do {\
+                          size_t len__ = (l);\
+                          for (;; p++) {\
+                            if (p == end - len__) goto fail;\
+                            if (mem_equal(p, x, len__)) break;\
+                          }\
+                          p += len__;\
+                        } while (0)
+#define P_AFTER(s)      P_AFTERL(s, strlen(s))
+
+const void *sb_get_multipart(sb_Stream *st, const char *name, size_t *len) {
+  const char *boundary;
+  size_t boundary_len;
+  size_t name_len = strlen(name);
+  const char *p = st->recv_buf.s;
+  char *end = st->recv_buf.s + st->request_len;
+
+  /* Get boundary string */
+  P_ATCHK( find_header_value(p, "Content-Type") );
+  P_AFTER( "boundary=" );
+  boundary = p;
+  P_AFTER( "\r\n" );
+  boundary_len = p - boundary - 2;
+
+next:
+  /* Move to after first boundary, then to start of name */
+  P_AFTERL( boundary, boundary_len );
+  P_AFTER( "\r\n" );
+  P_ATCHK( find_header_value(p, "Content-Disposition") );
+  P_AFTER( "name=\"" );
+
+  /* Does the name match what we were looking for? */
+  if (mem_equal(p, name, name_len) && p[name_len] == '"') {
+    const char *res;
+    /* Move to start of data */
+    P_AFTER( "\r\n\r\n" );
+    res = p;
+    /* Find boundary, set length and return result */
+    P_AFTERL( boundary, boundary_len );
+    *len = p - res - boundary_len - 4;
+    return res;
+  }
+
+  /* Try the next part */
+  goto next;
+
+fail:
+  *len = 0;
+  return NULL;
+}
+
+
+/*===========================================================================
+ * Connections
+ *===========================================================================*/
+
+static void sb_server_tick(sb_Server *srv) {
+  /* Get and store current time, once per poll; the Date header which goes
+   * on every response is only rewritten when the second changes */
+  time_t now = time(NULL);
+  if (now != srv->now || !srv->date_header[0]) {
+    memcpy(srv->date_header, "Date: ", 6);
+    sb_format_http_date(now, srv->date_header + 6);
+    memcpy(srv->date_header + 35, "\r\n", 3);
+  }
+  srv->now = now;
+}
+
+
+static void sb_server_link_stream(sb_Server *srv, sb_Stream *st) {
+  st->prev = NULL;
+  st->next = srv->streams;
+  if (srv->streams) srv->streams->prev = st;
+  srv->streams = st;
+}
+
+
+static void sb_server_unlink_stream(sb_Server *srv, sb_Stream *st) {
+  if (st->prev) {
+    st->prev->next = st->next;
+  } else {
+    srv->streams = st->next;
+  }
+  if (st->next) st->next->prev = st->prev;
+}
+
+
+static void sb_server_check_stream(sb_Server *srv, sb_Stream *st) {
+  /* Is the stream kept alive and waiting for its next request? */
+  int idle = st->requests && st->state == STATE_RECEIVING_HEADER &&
+             st->recv_buf.len == 0;
+
+  /* Check stream against timeout, max request length and max lifetime */
+  if (
+    (srv->timeout && srv->now - st->last_activity > srv->timeout / 1000) ||
+    (idle && srv->now - st->last_activity > srv->keep_alive_timeout / 1000) ||
+    (srv->max_lifetime &&
+     srv->now - st->init_time > srv->max_lifetime / 1000) ||
+    (srv->max_request_size && st->recv_buf.len >= srv->max_request_size)
+  ) {
+    sb_stream_close(st);
+  }
+}
+
+
+static sb_Stream *sb_server_add_stream(sb_Server *srv, sb_Socket sockfd,
+                                        int *err) {
+  sb_Stream *st;
+  sb_Event e;
+
+  /* Init new stream */
+  st = sb_stream_new(srv, sockfd);
+  if (!st) {
+    close(sockfd);
+    *err = SB_EOUTOFMEM;
+    return NULL;
+  }
+
+#ifdef SB_USE_EPOLL
+  /* Register the stream once; its interest set is only touched again when
+   * it switches between receiving and sending */
+  if (srv->epfd != -1) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = st;
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+      close(sockfd);
+      free(st);
+      *err = SB_EFAILURE;
+      return NULL;
+    }
+    st->events = EPOLLIN;
+  }
+#endif
+
+  /* Push stream to list */
+  sb_server_link_stream(srv, st);
+
+  /* Do `connect` event */
+  e.type = SB_EV_CONNECT;
+  *err = sb_stream_emit(st, &e);
+  return st;
+}
+
+
+static int sb_server_accept(sb_Server *srv) {
+  sb_Socket sockfd;
+  int err;
+
+  /* Accept connections */
+  while ( (sockfd = accept(srv->sockfd, NULL, NULL)) != INVALID_SOCKET ) {
+
+#if defined(_WIN32)
+    /* As the fd_set on windows is an array rather than a bitset, an fd
+     * value can never be too large for it; thus this check is omitted */
+#elif !defined(SB_USE_EPOLL)
+    /* Check FD size, error if it is larger than FD_SETSIZE */
+    if (sockfd > FD_SETSIZE) {
+      close(sockfd);
+      return SB_EFDTOOBIG;
+    }
+#endif
+
+    sb_server_add_stream(srv, sockfd, &err);
+    if (err) return err;
+  }
+
+  return SB_ESUCCESS;
+}
+
+
+/*===========================================================================
+ * io_uring
+ *===========================================================================*/
+
+#ifdef SB_USE_IO_URING
+
+#define SB_URING_ENTRIES    1024
+#define SB_URING_CQ_ENTRIES 8192
+#define SB_URING_BUFS       512     /* Provided recv buffers (power of two) */
+#define SB_URING_BUF_SIZE   4096
+#define SB_URING_BGID       0
+
+/* The low bits of a completion's user_data hold the operation, the rest is
+ * the stream pointer; the listening socket's multishot accept is 0 and the
+ * file cache's inotify poll has no stream */
+enum {
+  SB_URING_ACCEPT,
+  SB_URING_RECV,
+  SB_URING_SEND,
+  SB_URING_READ,
+  SB_URING_WATCH
+};
+
+#define SB_URING_OP_MASK 7
+
+typedef struct sb_Uring sb_Uring;
+
+struct sb_Uring {
+  int fd;                         /* Ring file descriptor */
+  unsigned *sq_head, *sq_tail;    /* Submission queue, shared with kernel */
+  unsigned *sq_mask, *sq_array;
+  unsigned sq_entries;
+  unsigned sqe_tail;              /* Local tail, published on submit */
+  unsigned *cq_head, *cq_tail;    /* Completion queue, shared with kernel */
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_sz;
+  char *bufs;                     /* Memory backing the provided buffers */
+  unsigned short buf_tail;
+};
+
+
+static int sb_uring_enter(sb_Uring *u, unsigned to_submit,
+                          unsigned min_complete, unsigned flags,
+                          void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete, flags,
+                 arg, argsz);
+}
+
+
+static void sb_uring_free(sb_Uring *u) {
+  if (u->fd != -1) close(u->fd);
+  if (u->sq_ring && u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_ring_sz);
+  if (u->cq_ring && u->cq_ring != MAP_FAILED) munmap(u->cq_ring, u->cq_ring_sz);
+  if (u->sqes && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_sz);
+  if (u->buf_ring && u->buf_ring != MAP_FAILED) {
+    munmap(u->buf_ring, u->buf_ring_sz);
+  }
+  free(u->bufs);
+  free(u);
+}
+
+
+static void sb_uring_recycle(sb_Uring *u, unsigned bid) {
+  struct io_uring_buf *buf;
+  buf = &u->buf_ring->bufs[u->buf_tail & (SB_URING_BUFS - 1)];
+  buf->addr = (unsigned long) (u->bufs + (size_t) bid * SB_URING_BUF_SIZE);
+  buf->len = SB_URING_BUF_SIZE;
+  buf->bid = bid;
+  u->buf_tail++;
+  __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+
+static sb_Uring *sb_uring_new(void) {
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  sb_Uring *u;
+  unsigned i;
+
+  u = malloc( sizeof(*u) );
+  if (!u) return NULL;
+  memset(u, 0, sizeof(*u));
+
+  /* Create the ring; a kernel without io_uring fails here with ENOSYS */
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = SB_URING_CQ_ENTRIES;
+  u->fd = syscall(__NR_io_uring_setup, SB_URING_ENTRIES, &p);
+  if (u->fd < 0) {
+    u->fd = -1;
+    goto fail;
+  }
+  if (!(p.features & IORING_FEAT_NODROP)) goto fail;
+
+  /* Map the submission and completion rings and the SQE array */
+  u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED) goto fail;
+  u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  if (u->cq_ring == MAP_FAILED) goto fail;
+  u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) goto fail;
+
+  u->sq_head = (unsigned*) ((char*) u->sq_ring + p.sq_off.head);
+  u->sq_tail = (unsigned*) ((char*) u->sq_ring + p.sq_off.tail);
+  u->sq_mask = (unsigned*) ((char*) u->sq_ring + p.sq_off.ring_mask);
+  u->sq_array = (unsigned*) ((char*) u->sq_ring + p.sq_off.array);
+  u->sq_entries = p.sq_entries;
+  u->sqe_tail = *u->sq_tail;
+  u->cq_head = (unsigned*) ((char*) u->cq_ring + p.cq_off.head);
+  u->cq_tail = (unsigned*) ((char*) u->cq_ring + p.cq_off.tail);
+  u->cq_mask = (unsigned*) ((char*) u->cq_ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*) ((char*) u->cq_ring + p.cq_off.cqes);
+
+  /* Register the provided buffer ring used by recv; this requires Linux 5.19,
+   * which also provides the multishot accept we rely on */
+  u->buf_ring_sz = SB_URING_BUFS * sizeof(struct io_uring_buf);
+  u->buf_ring = mmap(NULL, u->buf_ring_sz, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->buf_ring == MAP_FAILED) goto fail;
+  u->bufs = malloc((size_t) SB_URING_BUFS * SB_URING_BUF_SIZE);
+  if (!u->bufs) goto fail;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) u->buf_ring;
+  reg.ring_entries = SB_URING_BUFS;
+  reg.bgid = SB_URING_BGID;
+  if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) < 0) {
+    goto fail;
+  }
+  for (i = 0; i < SB_URING_BUFS; i++) {
+    sb_uring_recycle(u, i);
+  }
+
+  return u;
+
+fail:
+  sb_uring_free(u);
+  return NULL;
+}
+
+
+static unsigned sb_uring_flush(sb_Uring *u) {
+  /* Publish locally queued SQEs, returns how many are waiting for submit */
+  __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+  return u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+
+static struct io_uring_sqe *sb_uring_get_sqe(sb_Uring *u) {
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+
+  /* Submit what we have if the submission queue is full */
+  if (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+      u->sq_entries) {
+    sb_uring_enter(u, sb_uring_flush(u), 0, 0, NULL, 0);
+  }
+
+  idx = u->sqe_tail & *u->sq_mask;
+  u->sq_array[idx] = idx;
+  u->sqe_tail++;
+  sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+
+static int sb_uring_arm_accept(sb_Server *srv) {
+  struct io_uring_sqe *sqe = sb_uring_get_sqe(srv->uring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = srv->sockfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = SB_URING_ACCEPT;
+  return SB_ESUCCESS;
+}
 
-  /* Find beginning of query string */
-  q = st->recv_buf.s + strcspn(st->recv_buf.s, "?\r");
-  q = (*q == '?') ? (q + 1) : NULL;
 
-  /* Try to get var from query string, then data string */
-  if (q) s = find_var_value(q, name);
-  if (!s && st->data_idx) {
-    s = find_var_value(st->recv_buf.s + st->data_idx, name);
+static int sb_uring_arm_watch(sb_Server *srv) {
+  struct io_uring_sqe *sqe = sb_uring_get_sqe(srv->uring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = srv->files.inotify_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = SB_URING_WATCH;
+  return SB_ESUCCESS;
+}
+
+
+static int sb_uring_arm(sb_Stream *st) {
+  sb_Uring *u = st->server->uring;
+  struct io_uring_sqe *sqe;
+  int err;
+
+  /* Each stream has at most one operation in flight, so send_buf is never
+   * touched while the kernel may be reading from it */
+  if (st->inflight || st->state == STATE_CLOSING) {
+    return SB_ESUCCESS;
   }
-  if (!s) {
-    *dst = '\0';
-    return SB_ENOTFOUND;
+
+  for (;;) {
+    if (st->send_buf.len > 0 || st->send_data) {
+      /* send_buf goes first, then any body sent in place */
+      sqe = sb_uring_get_sqe(u);
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = st->sockfd;
+      if (st->send_buf.len > 0) {
+        sqe->addr = (unsigned long) (st->send_buf.s + st->send_idx);
+        sqe->len = st->send_buf.len - st->send_idx;
+      } else {
+        sqe->addr = (unsigned long) (st->send_data + st->send_data_idx);
+        sqe->len = st->send_data_len - st->send_data_idx;
+      }
+      sqe->msg_flags = MSG_NOSIGNAL;
+      sqe->user_data = (unsigned long) st | SB_URING_SEND;
+      break;
+    }
+
+    if (st->state < STATE_SENDING_STATUS) {
+      /* Receive into a buffer picked by the kernel from the provided ring */
+      sqe = sb_uring_get_sqe(u);
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = st->sockfd;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = SB_URING_BGID;
+      sqe->user_data = (unsigned long) st | SB_URING_RECV;
+      break;
+    }
+
+    if (st->send_fd != -1) {
+      /* Read the next chunk of the file */
+      err = sb_buffer_reserve(&st->send_buf, 8192);
+      if (err) return err;
+      sqe = sb_uring_get_sqe(u);
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = st->send_fd;
+      sqe->off = st->send_offset;
+      sqe->addr = (unsigned long) st->send_buf.s;
+      sqe->len = st->send_remaining < st->send_buf.cap ?
+                 st->send_remaining : st->send_buf.cap;
+      sqe->user_data = (unsigned long) st | SB_URING_READ;
+      break;
+    }
+
+    /* Nothing to do until the response is resumed */
+    if (st->flags & STREAM_SUSPENDED) {
+      return SB_ESUCCESS;
+    }
+
+    /* Everything has been sent; the stream either closes or goes on to the
+     * next request */
+    err = sb_stream_complete(st);
+    if (err) return err;
+    if (st->state == STATE_CLOSING) return SB_ESUCCESS;
   }
-  return url_decode(dst, s, len);
+
+  st->inflight++;
+  return SB_ESUCCESS;
 }
 
 
-int sb_get_cookie(sb_Stream *st, const char *name, char *dst, size_t len) {
-  size_t n;
-  const char *s = st->recv_buf.s;
-  int res = SB_ESUCCESS;
-  size_t name_len = strlen(name);
+static void sb_uring_release(sb_Server *srv, sb_Stream *st) {
+  /* A closing stream can only be freed once the kernel has finished with it;
+   * shutting the socket down makes any pending recv or send complete */
+  if (st->inflight) {
+    shutdown(st->sockfd, SHUT_RDWR);
+    return;
+  }
+  sb_server_unlink_stream(srv, st);
+  sb_stream_destroy(st);
+}
 
-  /* Get cookie header */
-  s = find_header_value(st->recv_buf.s, "Cookie");
-  if (!s) goto fail;
 
-  /* Find var */
-  while (*s) {
-    s += strspn(s, " \t");
-    /* Found var? find value, get len, copy value and return */
-    if ( mem_case_equal(s, name, name_len) && strchr(" =", s[name_len]) ) {
-      s += name_len;
-      s += strspn(s, "= \t\r");
-      n = strcspn(s, ";\r");
-      if (n >= len - 1) {
-        n = len - 1;
-        res = SB_ETRUNCATED;
+static int sb_uring_rearm(sb_Server *srv, sb_Stream *st) {
+  /* Arming can finish a response and close the stream with nothing left in
+   * flight; it is released straight away rather than at the next sweep */
+  int err = sb_uring_arm(st);
+  if (st->state == STATE_CLOSING && !st->inflight) {
+    sb_uring_release(srv, st);
+  }
+  return err;
+}
+
+
+static int sb_uring_complete(sb_Server *srv, struct io_uring_cqe *cqe) {
+  sb_Uring *u = srv->uring;
+  int op = cqe->user_data & SB_URING_OP_MASK;
+  sb_Stream *st = (sb_Stream*) (unsigned long)
+                  (cqe->user_data & ~(unsigned long long) SB_URING_OP_MASK);
+  int res = cqe->res;
+  int err = SB_ESUCCESS;
+
+  if (op == SB_URING_ACCEPT) {
+    /* Re-arm the accept if the kernel has stopped the multishot */
+    if (!(cqe->flags & IORING_CQE_F_MORE)) sb_uring_arm_accept(srv);
+    if (res < 0) return SB_ESUCCESS;
+    st = sb_server_add_stream(srv, res, &err);
+    if (err) return err;
+    return sb_uring_rearm(srv, st);
+  }
+
+  if (op == SB_URING_WATCH) {
+    if (res < 0) return SB_ESUCCESS;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) sb_uring_arm_watch(srv);
+    sb_file_cache_sweep(srv);
+    return SB_ESUCCESS;
+  }
+
+  st->inflight--;
+
+  switch (op) {
+    case SB_URING_RECV:
+      if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && st->state != STATE_CLOSING) {
+          /* Copy out of the provided buffer so it can go straight back to
+           * the kernel */
+          err = sb_buffer_push_str(&st->recv_buf,
+                                   u->bufs + (size_t) bid * SB_URING_BUF_SIZE,
+                                   res);
+          if (!err) {
+            st->last_activity = srv->now;
+            err = sb_stream_process(st);
+          }
+        }
+        sb_uring_recycle(u, bid);
+        if (err) return err;
       }
-      memcpy(dst, s, n);
-      dst[n] = '\0';
-      return res;
-    }
-    s += strcspn(s, ";\r");
-    if (*s != ';') goto fail;
-    s++;
+      /* Disconnected? Running out of provided buffers just means retry */
+      if (res == 0 || (res < 0 && res != -ENOBUFS && res != -EAGAIN)) {
+        sb_stream_close(st);
+      }
+      break;
+
+    case SB_URING_SEND:
+      if (res > 0) {
+        if (st->state != STATE_CLOSING) sb_stream_on_sent(st, res);
+      } else if (res != -EAGAIN) {
+        sb_stream_close(st);
+      }
+      break;
+
+    case SB_URING_READ:
+      st->send_buf.len = (res > 0) ? res : 0;
+      sb_stream_on_file_read(st, res);
+      break;
   }
 
-fail:
-  *dst = '\0';
-  return SB_ENOTFOUND;
+  if (st->state != STATE_CLOSING) {
+    sb_server_check_stream(srv, st);
+  }
+  if (st->state == STATE_CLOSING) {
+    sb_uring_release(srv, st);
+    return SB_ESUCCESS;
+  }
+  return sb_uring_rearm(srv, st);
 }
 
 
-#define P_ATCHK(x)      do { if (!(p = (x))) goto fail; } while (0)
-#define P_AFTERL(x, l)  do {\
-                          size_t len__ = (l);\
-                          for (;; p++) {\
-                            if (p == end - len__) goto fail;\
-                            if (mem_equal(p, x, len__)) break;\
-                          }\
-                          p += len__;\
-                        } while (0)
-#define P_AFTER(s)      P_AFTERL(s, strlen(s))
+static int sb_uring_poll(sb_Server *srv, int timeout) {
+  sb_Uring *u = srv->uring;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned head, tail;
+  sb_Stream *st, *next;
+  int err;
 
-const void *sb_get_multipart(sb_Stream *st, const char *name, size_t *len) {
-  const char *boundary;
-  size_t boundary_len;
-  size_t name_len = strlen(name);
-  const char *p = st->recv_buf.s;
-  char *end = st->recv_buf.s + st->recv_buf.len;
+  /* Submit every operation queued since the last poll and wait for at least
+   * one completion, all in a single syscall */
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    arg.ts = (unsigned long) &ts;
+  }
+  sb_uring_enter(u, sb_uring_flush(u), timeout ? 1 : 0,
+                 IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                 &arg, sizeof(arg));
 
-  /* Get boundary string */
-  P_ATCHK( find_header_value(p, "Content-Type") );
-  P_AFTER( "boundary=" );
-  boundary = p;
-  P_AFTER( "\r\n" );
-  boundary_len = p - boundary - 2;
+  sb_server_tick(srv);
 
-next:
-  /* Move to after first boundary, then to start of name */
-  P_AFTERL( boundary, boundary_len );
-  P_AFTER( "\r\n" );
-  P_ATCHK( find_header_value(p, "Content-Disposition") );
-  P_AFTER( "name=\"" );
+  /* Handle completions */
+  head = *u->cq_head;
+  for (;;) {
+    struct io_uring_cqe cqe;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) break;
+    cqe = u->cqes[head & *u->cq_mask];
+    head++;
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    err = sb_uring_complete(srv, &cqe);
+    if (err) return err;
+  }
 
-  /* Does the name match what we were looking for? */
-  if (mem_equal(p, name, name_len) && p[name_len] == '"') {
-    const char *res;
-    /* Move to start of data */
-    P_AFTER( "\r\n\r\n" );
-    res = p;
-    /* Find boundary, set length and return result */
-    P_AFTERL( boundary, boundary_len );
-    *len = p - res - boundary_len - 4;
-    return res;
+  /* Check all streams against timeouts once the clock has ticked */
+  if (srv->now != srv->last_sweep) {
+    srv->last_sweep = srv->now;
+    for (st = srv->streams; st; st = next) {
+      next = st->next;
+      sb_server_check_stream(srv, st);
+      if (st->state == STATE_CLOSING) {
+        sb_uring_release(srv, st);
+      }
+    }
   }
 
-  /* Try the next part */
-  goto next;
+  /* Submit what handling the completions queued, such as the first recv of
+   * a new stream; a caller waiting on the ring's fd would otherwise sleep
+   * until something else woke it */
+  sb_uring_enter(u, sb_uring_flush(u), 0, 0, NULL, 0);
 
-fail:
-  *len = 0;
-  return NULL;
+  return SB_ESUCCESS;
 }
 
+#endif
+
 
 /*===========================================================================
  * Server
@@ -813,11 +2888,23 @@ sb_Server *sb_new_server(const sb_Options *opt) {
   if (!srv) goto fail;
   memset(srv, 0, sizeof(*srv));
   srv->sockfd = INVALID_SOCKET;
+#ifdef SB_USE_EPOLL
+  srv->epfd = -1;
+#endif
   srv->handler = opt->handler;
   srv->udata = opt->udata;
   srv->timeout = opt->timeout ? str_to_uint(opt->timeout) : 30000;
   srv->max_request_size = str_to_uint(opt->max_request_size);
   srv->max_lifetime = str_to_uint(opt->max_lifetime);
+  srv->keep_alive_timeout = opt->keep_alive_timeout ?
+                            str_to_uint(opt->keep_alive_timeout) : 5000;
+  srv->max_requests = opt->max_requests ?
+                      str_to_uint(opt->max_requests) : 1000;
+  srv->files.max_size = opt->file_cache_size ?
+                        str_to_uint(opt->file_cache_size) : 8 * 1024 * 1024;
+  srv->files.inotify_fd = -1;
+  srv->compress_min_size = opt->compress_min_size ?
+                           str_to_uint(opt->compress_min_size) : 0;
 
   /* Get addrinfo */
   memset(&hints, 0, sizeof(hints));
@@ -837,12 +2924,84 @@ sb_Server *sb_new_server(const sb_Options *opt) {
   optval = 1;
   setsockopt(srv->sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 
+  /* Set SO_REUSEPORT if asked to, so several servers can listen on the same
+   * port and have the kernel share connections out between them */
+  if (str_to_uint(opt->reuse_port)) {
+#ifdef SO_REUSEPORT
+    err = setsockopt(srv->sockfd, SOL_SOCKET, SO_REUSEPORT,
+                     &optval, sizeof(optval));
+    if (err) goto fail;
+#else
+    goto fail;
+#endif
+  }
+
   /* Bind and listen */
   err = bind(srv->sockfd, ai->ai_addr, ai->ai_addrlen);
   if (err) goto fail;
   err = listen(srv->sockfd, 1023);
   if (err) goto fail;
 
+#ifdef SB_USE_IO_URING
+  /* Prefer io_uring; fall back to epoll if the kernel cannot provide it */
+  srv->uring = sb_uring_new();
+  if (srv->uring) {
+    err = sb_uring_arm_accept(srv);
+    if (err) goto fail;
+  } else
+#endif
+#ifdef SB_USE_EPOLL
+  /* Create the epoll instance and register the listening socket; it is the
+   * only entry with a NULL `data.ptr`. The file cache's inotify instance is
+   * registered with a pointer to the cache */
+  {
+    struct epoll_event ev;
+    srv->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (srv->epfd == -1) goto fail;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    err = epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->sockfd, &ev);
+    if (err) goto fail;
+  }
+#endif
+
+#ifdef SB_USE_INOTIFY
+  /* Watch cached files for changes; the cache is swept only when the poller
+   * finds the inotify instance readable. Without it, files are checked with
+   * stat() instead */
+  if (srv->files.max_size > 0) {
+    srv->files.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  }
+#ifdef SB_USE_EPOLL
+  if (srv->files.inotify_fd != -1) {
+#ifdef SB_USE_IO_URING
+    if (srv->uring) {
+      sb_uring_arm_watch(srv);
+    } else
+#endif
+    {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = &srv->files;
+      if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->files.inotify_fd, &ev)) {
+        close(srv->files.inotify_fd);
+        srv->files.inotify_fd = -1;
+      }
+    }
+  }
+#endif
+#endif
+
+#ifdef SB_USE_IO_URING
+  /* Submit the accept now, so the ring's fd can be waited on before the
+   * first poll */
+  if (srv->uring) {
+    sb_uring_enter(srv->uring, sb_uring_flush(srv->uring), 0, 0, NULL, 0);
+  }
+#endif
+
   /* Clean up */
   freeaddrinfo(ai);
   ai = NULL;
@@ -857,6 +3016,23 @@ fail:
 
 
 void sb_close_server(sb_Server *srv) {
+#ifdef SB_USE_IO_URING
+  /* Tear down the ring first so no operation still refers to a stream */
+  if (srv->uring) sb_uring_free(srv->uring);
+#endif
+
+  sb_file_cache_free(&srv->files);
+
+#ifdef SB_USE_ZLIB
+  {
+    int i;
+    for (i = 0; i < 2; i++) {
+      if (srv->deflaters[i]) deflateEnd(srv->deflaters[i]);
+      free(srv->deflaters[i]);
+    }
+  }
+#endif
+
   /* Destroy all streams */
   while (srv->streams) {
     sb_Stream *st = srv->streams;
@@ -868,12 +3044,117 @@ void sb_close_server(sb_Server *srv) {
   if (srv->sockfd != INVALID_SOCKET) {
     close(srv->sockfd);
   }
+#ifdef SB_USE_EPOLL
+  if (srv->epfd != -1) {
+    close(srv->epfd);
+  }
+#endif
   free(srv);
 }
 
 
+#ifdef SB_USE_EPOLL
+
+static void sb_stream_update_events(sb_Stream *st) {
+  struct epoll_event ev;
+  int events = sb_stream_wants_send(st) ? EPOLLOUT : EPOLLIN;
+  /* A suspended stream only waits for errors and hangups, so a client which
+   * half-closes after its request still gets the response */
+  if (events == EPOLLIN && (st->flags & STREAM_SUSPENDED)) events = 0;
+  if (events == st->events) return;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = st;
+  epoll_ctl(st->server->epfd, EPOLL_CTL_MOD, st->sockfd, &ev);
+  st->events = events;
+}
+
+
+int sb_poll_server(sb_Server *srv, int timeout) {
+  struct epoll_event evs[SB_MAX_EVENTS];
+  sb_Stream *st, *next;
+  int i, n, err, accepting = 0;
+
+#ifdef SB_USE_IO_URING
+  if (srv->uring) return sb_uring_poll(srv, timeout);
+#endif
+
+  /* Wait for events */
+  n = epoll_wait(srv->epfd, evs, SB_MAX_EVENTS, timeout);
+  if (n < 0) n = 0;
+
+  sb_server_tick(srv);
+
+  /* Handle ready streams */
+  for (i = 0; i < n; i++) {
+    /* Drop changed files from the cache */
+    if (evs[i].data.ptr == &srv->files) {
+      sb_file_cache_sweep(srv);
+      continue;
+    }
+
+    st = evs[i].data.ptr;
+
+    /* The listening socket is handled after the existing streams */
+    if (!st) {
+      accepting = 1;
+      continue;
+    }
+
+    /* Receive data */
+    if (st->state != STATE_CLOSING && !sb_stream_wants_send(st) &&
+        (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+      err = sb_stream_recv(st);
+      if (err) return err;
+    }
+
+    /* Send data; a stream which has just received a full request is sent to
+     * straight away as its socket is almost always writable */
+    if (sb_stream_wants_send(st)) {
+      err = sb_stream_send(st);
+      if (err) return err;
+    }
+
+    /* Check request size; timeouts are checked below once a second */
+    if (srv->max_request_size && st->recv_buf.len >= srv->max_request_size) {
+      sb_stream_close(st);
+    }
+
+    /* Handle disconnect -- destroy stream */
+    if (st->state == STATE_CLOSING) {
+      sb_server_unlink_stream(srv, st);
+      sb_stream_destroy(st);
+      continue;
+    }
+
+    sb_stream_update_events(st);
+  }
+
+  /* Check all streams against timeouts once the clock has ticked */
+  if (srv->now != srv->last_sweep) {
+    srv->last_sweep = srv->now;
+    for (st = srv->streams; st; st = next) {
+      next = st->next;
+      sb_server_check_stream(srv, st);
+      if (st->state == STATE_CLOSING) {
+        sb_server_unlink_stream(srv, st);
+        sb_stream_destroy(st);
+      }
+    }
+  }
+
+  /* Handle new streams */
+  if (accepting) {
+    return sb_server_accept(srv);
+  }
+
+  return SB_ESUCCESS;
+}
+
+#else
+
 int sb_poll_server(sb_Server *srv, int timeout) {
-  sb_Stream *st, **st_next;
+  sb_Stream *st, *next;
   fd_set fds_read, fds_write;
   sb_Socket max_fd = srv->sockfd;
   struct timeval tv;
@@ -886,11 +3167,19 @@ int sb_poll_server(sb_Server *srv, int timeout) {
   /* Add server sockfd to fd_set */
   FD_SET(srv->sockfd, &fds_read);
 
+#ifdef SB_USE_INOTIFY
+  /* Add the file cache's inotify instance */
+  if (srv->files.inotify_fd != -1) {
+    FD_SET(srv->files.inotify_fd, &fds_read);
+    if (srv->files.inotify_fd > max_fd) max_fd = srv->files.inotify_fd;
+  }
+#endif
+
   /* Add streams to fd_sets */
   for (st = srv->streams; st; st = st->next) {
-    if (st->state >= STATE_SENDING_STATUS) {
+    if (sb_stream_wants_send(st)) {
       FD_SET(st->sockfd, &fds_write);
-    } else {
+    } else if (!(st->flags & STREAM_SUSPENDED)) {
       FD_SET(st->sockfd, &fds_read);
     }
     if (st->sockfd > max_fd) max_fd = st->sockfd;
@@ -903,13 +3192,19 @@ int sb_poll_server(sb_Server *srv, int timeout) {
   /* Do select */
   select(max_fd + 1, &fds_read, &fds_write, NULL, &tv);
 
-  /* Get and store current time */
-  srv->now = time(NULL);
+  sb_server_tick(srv);
+
+#ifdef SB_USE_INOTIFY
+  /* Drop changed files from the cache */
+  if (srv->files.inotify_fd != -1 &&
+      FD_ISSET(srv->files.inotify_fd, &fds_read)) {
+    sb_file_cache_sweep(srv);
+  }
+#endif
 
   /* Handle existing streams */
-  st_next = &srv->streams;
-  while (*st_next) {
-    st = *st_next;
+  for (st = srv->streams; st; st = next) {
+    next = st->next;
 
     /* Receive data */
     if (FD_ISSET(st->sockfd, &fds_read)) {
@@ -923,63 +3218,75 @@ int sb_poll_server(sb_Server *srv, int timeout) {
       if (err) return err;
     }
 
-    /* Check stream against timeout, max request length and max lifetime */
-    if (
-      (srv->timeout && srv->now - st->last_activity > srv->timeout / 1000) ||
-      (srv->max_lifetime &&
-       srv->now - st->init_time > srv->max_lifetime / 1000) ||
-      (srv->max_request_size && st->recv_buf.len >= srv->max_request_size)
-    ) {
-      sb_stream_close(st);
-    }
+    sb_server_check_stream(srv, st);
 
     /* Handle disconnect -- destroy stream */
     if (st->state == STATE_CLOSING) {
-      *st_next = st->next;
+      sb_server_unlink_stream(srv, st);
       sb_stream_destroy(st);
-      continue;
     }
-
-    /* Next */
-    st_next = &(*st_next)->next;
   }
 
   /* Handle new streams */
   if (FD_ISSET(srv->sockfd, &fds_read)) {
-    sb_Event e;
-    sb_Socket sockfd;
+    return sb_server_accept(srv);
+  }
+
+  return SB_ESUCCESS;
+}
 
-    /* Accept connections */
-    while ( (sockfd = accept(srv->sockfd, NULL, NULL)) != INVALID_SOCKET ) {
+#endif
 
-#ifdef _WIN32
-      /* As the fd_set on windows is an array rather than a bitset, an fd
-       * value can never be too large for it; thus this check is omitted */
+
+int sb_get_server_fd(sb_Server *srv) {
+  /* A descriptor which is readable whenever sb_poll_server() has work to do,
+   * for running the server from another event loop */
+#ifdef SB_USE_IO_URING
+  if (srv->uring) return srv->uring->fd;
+#endif
+#ifdef SB_USE_EPOLL
+  return srv->epfd;
 #else
-      /* Check FD size, error if it is larger than FD_SETSIZE */
-      if (sockfd > FD_SETSIZE) {
-        close(sockfd);
-        return SB_EFDTOOBIG;
-      }
+  (void) srv;
+  return -1;
 #endif
+}
 
-      /* Init new stream */
-      st = sb_stream_new(srv, sockfd);
-      if (!st) {
-        close(sockfd);
-        return SB_EOUTOFMEM;
-      }
 
-      /* Push stream to list */
-      st->next = srv->streams;
-      srv->streams = st;
+int sb_suspend(sb_Stream *st) {
+  /* Only the response to the request being handled can be suspended */
+  if (st->state < STATE_SENDING_STATUS || st->state == STATE_CLOSING) {
+    return SB_EBADSTATE;
+  }
+  st->flags |= STREAM_SUSPENDED;
+  return SB_ESUCCESS;
+}
+
 
-      /* Do `connect` event */
-      e.type = SB_EV_CONNECT;
-      err = sb_stream_emit(st, &e);
-      if (err) return err;
-    }
+int sb_resume(sb_Stream *st) {
+  int err;
+  if (!(st->flags & STREAM_SUSPENDED)) return SB_EBADSTATE;
+  st->flags &= ~STREAM_SUSPENDED;
+
+  /* Terminate the header block of a response which has no body */
+  if (st->state == STATE_SENDING_HEADER) {
+    err = sb_stream_finalize_header(st);
+    if (err) return err;
   }
 
+  /* Have the stream's socket watched for writing again */
+#ifdef SB_USE_IO_URING
+  if (st->server->uring) {
+    sb_Uring *u = st->server->uring;
+    err = sb_uring_rearm(st->server, st);
+    if (err) return err;
+    /* Submit now, as the next poll may only come once something completes */
+    sb_uring_enter(u, sb_uring_flush(u), 0, 0, NULL, 0);
+    return SB_ESUCCESS;
+  }
+#endif
+#ifdef SB_USE_EPOLL
+  sb_stream_update_events(st);
+#endif
   return SB_ESUCCESS;
-}
\ No newline at end of file
+}
@@ -11,6 +11,7 @@
 
 #include <stddef.h>
 #include <stdarg.h>
+#include "http_parser.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -23,6 +24,7 @@ typedef struct sb_Stream  sb_Stream;
 typedef struct sb_Event   sb_Event;
 typedef struct sb_Options sb_Options;
 typedef int (*sb_Handler)(sb_Event*);
+typedef void (*sb_Release)(const void *data);
 
 #ifdef _WIN32
   typedef SOCKET sb_Socket;
@@ -32,8 +34,12 @@ typedef int (*sb_Handler)(sb_Event*);
 #endif
 
 typedef struct sb_Buffer sb_Buffer;
+typedef struct sb_Span   sb_Span;
+typedef struct sb_Header sb_Header;
 
 struct sb_Buffer { char *s; size_t len, cap; };
+struct sb_Span   { size_t idx, len; };
+struct sb_Header { sb_Span name, value; };
 
 
 struct sb_Event {
@@ -54,6 +60,11 @@ struct sb_Options {
   const char *timeout;
   const char *max_lifetime;
   const char *max_request_size;
+  const char *keep_alive_timeout;
+  const char *max_requests;
+  const char *reuse_port;
+  const char *file_cache_size;
+  const char *compress_min_size;
 };
 
 struct sb_Stream {
@@ -62,12 +73,32 @@ struct sb_Stream {
   char address[46];           /* Remote IP address */
   time_t init_time;           /* Time the stream was created */
   time_t last_activity;       /* Time of Last I/O activity on the stream */
-  size_t expected_recv_len;   /* Expected length of the stream's request */
-  size_t data_idx;            /* Index of data section in recv_buf */
+  http_parser parser;         /* Incremental parser for the current request */
+  size_t parse_idx;           /* Index of the first unparsed byte in recv_buf */
+  sb_Span url;                /* Request target, as a span of recv_buf */
+  sb_Span body;               /* Request body, as a span of recv_buf */
+  sb_Header *headers;         /* Header fields, as spans of recv_buf */
+  size_t header_count;        /* Number of header fields in headers */
+  size_t header_cap;          /* Capacity of headers */
+  size_t request_len;         /* Length of the request being handled */
+  char request_end;           /* Byte after the request, while terminated */
+  unsigned requests;          /* Requests received on this connection */
+  int flags;                  /* Flags for the current request/response */
   sb_Socket sockfd;           /* Socket for this streams connection */
   sb_Buffer recv_buf;         /* Data received from client */
   sb_Buffer send_buf;         /* Data waiting to be sent to client */
-  FILE *send_fp;              /* File currently being sent to client */
+  size_t send_idx;            /* Index of the first unsent byte in send_buf */
+  int send_fd;                /* File currently being sent to client */
+  size_t send_offset;         /* Offset of the file's next unsent byte */
+  size_t send_remaining;      /* Bytes of the file still to be sent */
+  const char *send_data;      /* Caller's body being sent in place, or NULL */
+  size_t send_data_len;       /* Length of send_data */
+  size_t send_data_idx;       /* Index of the first unsent byte in send_data */
+  sb_Release send_data_release; /* Called once send_data is finished with */
+  int events;                 /* Events the socket is registered for */
+  int inflight;               /* Asynchronous operations still in flight */
+  void *udata;                /* User data for this stream */
+  sb_Stream *prev;            /* Previous stream in linked list */
   sb_Stream *next;            /* Next stream in linked list */
 };
 
@@ -98,10 +129,15 @@ const char *sb_error_str(int code);
 sb_Server *sb_new_server(const sb_Options *opt);
 void sb_close_server(sb_Server *srv);
 int sb_poll_server(sb_Server *srv, int timeout);
+int sb_get_server_fd(sb_Server *srv);
+int sb_suspend(sb_Stream *st);
+int sb_resume(sb_Stream *st);
 int sb_send_status(sb_Stream *st, int code, const char *msg);
 int sb_send_header(sb_Stream *st, const char *field, const char *val);
 int sb_send_file(sb_Stream *st, const char *filename);
 int sb_write(sb_Stream *st, const void *data, size_t len);
+int sb_send_body(sb_Stream *st, const void *data, size_t len, int compress,
+                 sb_Release release);
 int sb_vwritef(sb_Stream *st, const char *fmt, va_list args);
 int sb_writef(sb_Stream *st, const char *fmt, ...);
 int sb_get_header(sb_Stream *st, const char *field, char *dst, size_t len);